@@ -26,10 +26,12 @@
 #ifndef UTF8_H_
 #define UTF8_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
-#define UTF8_ACCEPT 0
-#define UTF8_REJECT 12
+/* States of the reference DFA, utf8_decode_ref() */
+#define UTF8_REF_ACCEPT 0
+#define UTF8_REF_REJECT 12
 
 static const uint8_t utf8d[] = {
     // The first part of the table maps bytes to character classes that
@@ -53,28 +55,33 @@ static const uint8_t utf8d[] = {
 };
 
 /*
+ * The reference implementation of the DFA, which is kept to verify the
+ * faster utf8_decode() below.
+ *
  * This function implements a *single* step in decoding a UTF-8 character.
  * Except the byte parameter that accepts the byte to decode, it takes two
  * parameters maintaining the state, and returns the state achieved after
  * processing the byte.
  *
  * Return values:
- * - UTF8_ACCEPT: enough bytes have been read for a character
- * - UTF8_REJECT: the byte is not allowed to occur at its position
+ * - UTF8_REF_ACCEPT: enough bytes have been read for a character
+ * - UTF8_REF_REJECT: the byte is not allowed to occur at its position
  * - other positive value: more bytes have to be read
  *
  * When decoding the first byte of a string, the caller must set $state =
- * UTF8_ACCEPT.  If, after decoding one or more bytes the state UTF8_ACCEPT
- * is reached again, then the decoded Unicode character value is available
- * through the $codep parameter.  If the state UTF8_REJECT is entered, that
- * state will never be exited unless the caller intervenes.
+ * UTF8_REF_ACCEPT.  If, after decoding one or more bytes the state
+ * UTF8_REF_ACCEPT is reached again, then the decoded Unicode character
+ * value is available through the $codep parameter.  If the state
+ * UTF8_REF_REJECT is entered, that state will never be exited unless the
+ * caller intervenes.  Note that these states differ from those of
+ * utf8_decode().
  */
 static inline uint32_t
-utf8_decode(uint32_t *state, uint32_t *codep, uint32_t byte)
+utf8_decode_ref(uint32_t *state, uint32_t *codep, uint32_t byte)
 {
     uint32_t type = utf8d[byte];
 
-    *codep = (*state != UTF8_ACCEPT) ?
+    *codep = (*state != UTF8_REF_ACCEPT) ?
              (byte & 0x3fu) | (*codep << 6) :
              (0xff >> type) & (byte);
 
@@ -82,4 +89,236 @@ utf8_decode(uint32_t *state, uint32_t *codep, uint32_t byte)
     return *state;
 }
 
+
+/*
+ * The same DFA in the shift-based form: the 9 states are numbered by
+ * multiples of 6, and the entry of every byte packs the next state of
+ * each state into a 6-bit field at the bit offset of that state, so a
+ * step is a single table load, shift and mask, instead of the character
+ * class lookup followed by the dependent transition lookup.  The top 8
+ * bits of the entry hold the mask of the payload bits of the byte as a
+ * leading byte, i.e., (0xff >> type) of the reference.
+ *
+ * Generated from utf8d[]; see utf8_verify() in xtf8_bench.c.
+ */
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 6
+
+static const uint64_t utf8_shift[256] = {
+    /* 0x00..0x0F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x10..0x1F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x20..0x2F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x30..0x3F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x40..0x4F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x50..0x5F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x60..0x6F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x70..0x7F */
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    0xff06186186186180ULL, 0xff06186186186180ULL,
+    /* 0x80..0x8F */
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    0x7f12486306300186ULL, 0x7f12486306300186ULL,
+    /* 0x90..0x9F */
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    0x0006492306300186ULL, 0x0006492306300186ULL,
+    /* 0xA0..0xAF */
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    /* 0xB0..0xBF */
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    0x010649218c300186ULL, 0x010649218c300186ULL,
+    /* 0xC0..0xCF */
+    0x0006186186186186ULL, 0x0006186186186186ULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    /* 0xD0..0xDF */
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    0x3f0618618618618cULL, 0x3f0618618618618cULL,
+    /* 0xE0..0xEF */
+    0x0006186186186198ULL, 0x1f06186186186192ULL,
+    0x1f06186186186192ULL, 0x1f06186186186192ULL,
+    0x1f06186186186192ULL, 0x1f06186186186192ULL,
+    0x1f06186186186192ULL, 0x1f06186186186192ULL,
+    0x1f06186186186192ULL, 0x1f06186186186192ULL,
+    0x1f06186186186192ULL, 0x1f06186186186192ULL,
+    0x1f06186186186192ULL, 0x0f0618618618619eULL,
+    0x1f06186186186192ULL, 0x1f06186186186192ULL,
+    /* 0xF0..0xFF */
+    0x00061861861861a4ULL, 0x03061861861861aaULL,
+    0x03061861861861aaULL, 0x03061861861861aaULL,
+    0x07061861861861b0ULL, 0x0006186186186186ULL,
+    0x0006186186186186ULL, 0x0006186186186186ULL,
+    0x0006186186186186ULL, 0x0006186186186186ULL,
+    0x0006186186186186ULL, 0x0006186186186186ULL,
+    0x0006186186186186ULL, 0x0006186186186186ULL,
+    0x0006186186186186ULL, 0x0006186186186186ULL,
+};
+
+/*
+ * A step of the DFA, with the same interface and results as
+ * utf8_decode_ref(), except that the states are numbered differently;
+ * compare them with UTF8_ACCEPT and UTF8_REJECT only.
+ */
+static inline uint32_t
+utf8_decode(uint32_t *state, uint32_t *codep, uint32_t byte)
+{
+    uint64_t t = utf8_shift[byte];
+
+    *codep = (*state != UTF8_ACCEPT) ?
+             (byte & 0x3fu) | (*codep << 6) :
+             (uint32_t)(t >> 56) & byte;
+
+    *state = (uint32_t)(t >> *state) & 63;
+    return *state;
+}
+
+/*
+ * Decode the complete UTF-8 sequence at the beginning of $s (of $len
+ * bytes, at least 1) in one step, dispatched by the leading byte; save
+ * the code point in $codep and return the length of the sequence.
+ *
+ * Return 0 if the sequence is invalid or incomplete, where running the
+ * DFA from the same position would reject or not reach UTF8_ACCEPT.
+ */
+static inline size_t
+utf8_next(const uint8_t *s, size_t len, uint32_t *codep)
+{
+    uint32_t c = s[0];
+
+    if (c < 0x80) {
+        *codep = c;
+        return 1;
+    }
+    if (c < 0xC2)
+        return 0; /* continuation or overlong */
+
+    if (c < 0xE0) {
+        if (len < 2 || (s[1] & 0xC0) != 0x80)
+            return 0;
+        *codep = (c & 0x1F) << 6 | (s[1] & 0x3Fu);
+        return 2;
+    }
+
+    if (c < 0xF0) {
+        if (len < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80)
+            return 0;
+        c = (c & 0x0F) << 12 | (s[1] & 0x3Fu) << 6 | (s[2] & 0x3Fu);
+        if (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))
+            return 0; /* overlong or surrogate */
+        *codep = c;
+        return 3;
+    }
+
+    if (c < 0xF5) {
+        if (len < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 ||
+            (s[3] & 0xC0) != 0x80)
+            return 0;
+        c = ((c & 0x07) << 18 | (s[1] & 0x3Fu) << 12 |
+             (s[2] & 0x3Fu) << 6 | (s[3] & 0x3Fu));
+        if (c < 0x10000 || c > 0x10FFFF)
+            return 0; /* overlong or out of range */
+        *codep = c;
+        return 4;
+    }
+
+    return 0;
+}
+
 #endif
@@ -24,11 +24,14 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "utf8.h" /* utf8_decode() */
 #include "xtf8.h"
+#include "xtf8_simd.h" /* xtf8_simd_get() */
 
 
 #ifdef  XTF8_DEBUG
@@ -50,74 +53,657 @@
 #define XTF8_PUA_START  0xEF80
 #define XTF8_PUA_END    0xEFFF
 
+/*
+ * Number of bytes to go through the DFA before retrying the fast path,
+ * after the fast path failed to skip anything.  This avoids repeatedly
+ * probing the fast path inside runs of binary bytes.
+ */
+#define XTF8_FAST_BACKOFF   16
+
+/*
+ * Maximum number of bytes to check with the DFA in a row before handing
+ * over to the vectorized kernel again.
+ */
+#define XTF8_SCALAR_RUN     64
+
+/*
+ * Longest run of text taken between the binary bytes by encode_lone()
+ * before leaving the rest to the vectorized passthrough().
+ */
+#define XTF8_LONE_TEXT      16
+
+/* Check 8 bytes at a time in a word, where the bytes are in order */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define XTF8_SWAR
+#define SWAR_HI         UINT64_C(0x8080808080808080)
+#endif
+
+/* Force inlining of the engines into their specialized variants */
+#if defined(__GNUC__)
+#define XTF8_INLINE     inline __attribute__((always_inline))
+#else
+#define XTF8_INLINE     inline
+#endif
+
+/*
+ * Minimum chunk size for each thread of the parallel codec, and the
+ * maximum number of threads.
+ */
+#ifndef XTF8_PARALLEL_CHUNK
+#define XTF8_PARALLEL_CHUNK (1024 * 1024)
+#endif
+#define XTF8_PARALLEL_MAX   64
+
 
 #ifndef NDEBUG
 
 /*
- * Verify whether the given $data of length $len is valid UTF-8 sequence.
+ * Verify whether the given $data of length $len is valid UTF-8 sequence,
+ * with the reference DFA independent of the engines.
  */
 static bool
-is_utf8(void *data, size_t len)
+is_utf8(const void *data, size_t len)
 {
-    unsigned char *p, *end;
+    const unsigned char *p, *end;
     uint32_t state, codepoint;
 
     p = data;
     end = p + len;
-    state = UTF8_ACCEPT;
+    state = UTF8_REF_ACCEPT;
 
     while (p < end) {
-        utf8_decode(&state, &codepoint, *p);
+        utf8_decode_ref(&state, &codepoint, *p);
         p++;
     }
 
-    return state == UTF8_ACCEPT;
+    return state == UTF8_REF_ACCEPT;
 }
 
 #endif
 
 
-uintptr_t
-xtf8_encode(void *dst, const void *src, size_t len, int error)
+/*
+ * Return the length of the leading part of $src (of length $len) that
+ * would be passed through unchanged by both the encoder and the decoder,
+ * i.e., complete and valid UTF-8 sequences without any code points
+ * inside the XTF8 encoding area.
+ *
+ * Each round skips the ASCII blocks by the vectorized ascii() kernel,
+ * and checks a short run by whole sequences with utf8_next(), which is
+ * cheap when a PUA sequence or an invalid byte is near, and gets past
+ * the block a kernel stopped at; then the vectorized utf8() kernel
+ * validates the blocks ahead in chunks that double while they're
+ * accepted, so a nearby stop doesn't cost a long scan.  If a chunk has
+ * PUA sequences, the first one is located in the validated prefix.
+ */
+static size_t
+passthrough(const uint8_t *src, size_t len)
+{
+    const uint8_t *s, *end, *stop, *p;
+    uint32_t codepoint;
+    size_t n, k, chunk, npua;
+
+    s = src;
+    end = src + len;
+    chunk = XTF8_SCALAR_RUN;
+
+    while (s < end) {
+        s += xtf8_simd_get()->ascii(s, (size_t)(end - s));
+        stop = (end - s > XTF8_SCALAR_RUN) ? s + XTF8_SCALAR_RUN : end;
+        while (s < stop) {
+            /* An incomplete sequence at the end is not passed through. */
+            n = utf8_next(s, (size_t)(end - s), &codepoint);
+            if (n == 0 || (codepoint >= XTF8_PUA_START &&
+                           codepoint <= XTF8_PUA_END))
+                return (size_t)(s - src);
+            s += n;
+        }
+        if (s == end)
+            break;
+
+        n = (size_t)(end - s);
+        if (n > chunk)
+            n = chunk;
+        npua = 0;
+        k = xtf8_simd_get()->utf8(s, n, &npua);
+        if (npua > 0) {
+            /*
+             * The prefix is valid UTF-8, so every 0xEE is a leading byte
+             * followed by a continuation, and it's a PUA sequence if
+             * that's 0xBE or 0xBF.
+             */
+            for (p = s; (p = memchr(p, 0xEE, k - (size_t)(p - s))); p++) {
+                if ((p[1] & 0xFE) == 0xBE)
+                    return (size_t)(p - src);
+            }
+            /* Not to pass through PUA unseen; leave it to the DFA. */
+            assert(0);
+            return (size_t)(s - src);
+        }
+        s += k;
+        chunk = (k >= n / 2 && chunk <= SIZE_MAX / 2) ?
+                chunk * 2 : XTF8_SCALAR_RUN;
+    }
+
+    return (size_t)(s - src);
+}
+
+
+/*
+ * Status of encode_run() and decode_run().
+ */
+enum {
+    RUN_DONE,   /* input consumed, except an incomplete trailing sequence */
+    RUN_FULL,   /* output buffer is full */
+    RUN_ABORT,  /* aborted due to error */
+};
+
+/*
+ * Add $n to the counter $field of $stats, if collecting statistics.
+ */
+#define STAT_ADD(stats, field, n) do {      \
+        if ((stats) != NULL)                \
+            (stats)->field += (n);          \
+    } while (0)
+
+/*
+ * Write a 3-byte UTF-8 sequence of a code point within U+0800..U+FFFF.
+ */
+#define PUT3(d, cp) do {                    \
+        *(d)++ = ((cp) >> 12 & 0x0F) | 0xE0; \
+        *(d)++ = ((cp) >> 6  & 0x3F) | 0x80; \
+        *(d)++ = ((cp)       & 0x3F) | 0x80; \
+    } while (0)
+
+/*
+ * Output of every byte encoded on its own, indexed by the byte: the
+ * ASCII characters as is (padded), and the binary bytes 0x80..0xFF as
+ * the UTF-8 sequences of the PUA code points U+EF80..U+EFFF.
+ */
+#define BYTE_SEQ(b)     { ((b) < 0x80) ? (b) : 0xEE,                    \
+                          ((b) < 0x80) ? 0 : 0xBE | (((b) >> 6) & 1),   \
+                          ((b) < 0x80) ? 0 : 0x80 | ((b) & 0x3F) }
+#define BYTE_SEQ4(b)    BYTE_SEQ(b), BYTE_SEQ((b) + 1), \
+                        BYTE_SEQ((b) + 2), BYTE_SEQ((b) + 3)
+#define BYTE_SEQ16(b)   BYTE_SEQ4(b), BYTE_SEQ4((b) + 4), \
+                        BYTE_SEQ4((b) + 8), BYTE_SEQ4((b) + 12)
+#define BYTE_SEQ64(b)   BYTE_SEQ16(b), BYTE_SEQ16((b) + 16), \
+                        BYTE_SEQ16((b) + 32), BYTE_SEQ16((b) + 48)
+
+static const uint8_t byte_seq[256][3] = {
+    BYTE_SEQ64(0x00), BYTE_SEQ64(0x40), BYTE_SEQ64(0x80), BYTE_SEQ64(0xC0),
+};
+
+/* Output length of byte $c encoded on its own, without branching */
+#define BYTE_LEN(c)     (1 + (((c) >> 6) & 2))
+
+/*
+ * Whether byte $c can't begin any valid UTF-8 sequence, i.e., it is a
+ * continuation byte, or always leads to an overlong or out-of-range
+ * sequence.  Such a byte is always encoded on its own.
+ */
+#define IS_LONE(c)      ((uint8_t)((c) - 0x80) < 0x42 || (c) >= 0xF5)
+
+/*
+ * Copy the UTF-8 sequence of $n (1..4) bytes at $s to $d with fixed-size
+ * moves instead of a byte loop, and return the end of $d.
+ */
+static inline uint8_t *
+copy_seq(uint8_t *d, const uint8_t *s, size_t n)
+{
+    switch (n) {
+    case 4:
+        memcpy(d, s, 4);
+        break;
+    case 3:
+        memcpy(d, s, 2);
+        d[2] = s[2];
+        break;
+    case 2:
+        memcpy(d, s, 2);
+        break;
+    default:
+        d[0] = s[0];
+        break;
+    }
+    return d + n;
+}
+
+/*
+ * Encode the leading binary data in $src of length $len, i.e., the run
+ * of binary bytes with short pieces of text in between, and return the
+ * number of bytes consumed, with the output length saved in $produced;
+ * the output is only counted if $d is NULL.  The $d must have room for
+ * ($len * 3) bytes.
+ *
+ * Besides the lone bytes (see IS_LONE()), the leading bytes of invalid
+ * sequences are encoded to PUA alone, the same as by the DFA in
+ * encode_core(), since their continuation bytes are lone bytes as well.
+ * The ASCII characters and valid sequences in between are copied, so
+ * that they don't each cost a round of encode_core(); but a run of text
+ * longer than XTF8_LONE_TEXT is left to the faster passthrough(), and
+ * so are PUA code points and incomplete sequences.  Without $ascii
+ * (i.e., JSON escaping), which would stop at about every other byte of
+ * binary data, only the run of lone bytes is taken.
+ *
+ * Branching on the kind of every byte is unpredictable in binary data,
+ * so the bytes are taken a word at a time: up to the first leading byte
+ * followed by a continuation byte, i.e., the only place a sequence can
+ * begin, all bytes are encoded alone by looking up byte_seq[] without
+ * branching, into a buffer for the part before it; and only that place
+ * is checked with utf8_next().  A word of continuation bytes is likely
+ * a long run of lone bytes, which is left to the vectorized binary
+ * kernel.
+ */
+static inline size_t
+encode_lone(uint8_t *d, const uint8_t *src, size_t len, bool ascii,
+            size_t *produced)
+{
+    uint32_t codepoint;
+    size_t i, o, n, ntext;
+    uint8_t c;
+#ifdef XTF8_SWAR
+    uint64_t x, y, flags, hi;
+    size_t j, k, oj[9];
+    uint8_t w[8 * 3];
+#endif
+
+    i = o = ntext = 0;
+
+    /* JSON escaping stops at every ASCII character. */
+    if (!ascii) {
+        if (d != NULL)
+            i = xtf8_simd_get()->binary(d, src, len);
+        for (; i < len && IS_LONE(src[i]); i++) {
+            if (d != NULL)
+                memcpy(d + i * 3, byte_seq[src[i]], 3);
+        }
+        *produced = i * 3;
+        return i;
+    }
+
+    /* With 4 bytes ahead, enough to tell an invalid sequence. */
+    while (len - i >= 4) {
+#ifdef XTF8_SWAR
+        /* Keeping 4 bytes ahead of any place found in the word */
+        if (len - i >= 12) {
+            memcpy(&x, src + i, 8);
+            memcpy(&y, src + i + 1, 8);
+            if ((x & SWAR_HI) == 0)
+                goto out; /* a word of ASCII */
+            if (d != NULL && (x & ~(x << 1) & SWAR_HI) == SWAR_HI) {
+                k = xtf8_simd_get()->binary(d + o, src + i, len - i);
+                if (k > 0) {
+                    i += k;
+                    o += k * 3;
+                    ntext = 0;
+                    continue;
+                }
+            }
+
+            /* The bytes 0xC0..0xFF followed by 0x80..0xBF */
+            flags = x & (x << 1) & y & ~(y << 1) & SWAR_HI;
+            k = (flags == 0) ? 8 : (size_t)__builtin_ctzll(flags) / 8;
+
+            /* Encode all the 8 bytes, and take the first k of them. */
+            oj[0] = 0;
+            for (j = 0; j < 8; j++) {
+                c = src[i + j];
+                memcpy(w + oj[j], byte_seq[c], 3);
+                oj[j + 1] = oj[j] + BYTE_LEN(c);
+            }
+            if (d != NULL)
+                memcpy(d + o, w, oj[k]);
+            hi = x & SWAR_HI;
+            if (k < 8)
+                hi &= (UINT64_C(1) << (k * 8)) - 1;
+            ntext = (hi == 0) ? ntext + k :
+                    k - 1 - (size_t)(63 - __builtin_clzll(hi)) / 8;
+            o += oj[k];
+            i += k;
+            if (ntext > XTF8_LONE_TEXT)
+                goto out;
+            if (k == 8)
+                continue;
+        }
+#endif
+
+        c = src[i];
+        if (c < 0x80) {
+            if (++ntext > XTF8_LONE_TEXT)
+                goto out;
+            if (d != NULL)
+                d[o] = c;
+            o++;
+            i++;
+            continue;
+        }
+
+        n = utf8_next(src + i, len - i, &codepoint);
+        if (n > 0) {
+            if ((codepoint >= XTF8_PUA_START &&
+                 codepoint <= XTF8_PUA_END) ||
+                (ntext += n) > XTF8_LONE_TEXT)
+                goto out;
+            if (d != NULL)
+                copy_seq(d + o, src + i, n);
+            o += n;
+            i += n;
+            continue;
+        }
+
+        ntext = 0;
+        if (d != NULL)
+            memcpy(d + o, byte_seq[c], 3);
+        o += 3;
+        i++;
+    }
+
+    /* The last bytes, but no sequences. */
+    for (; i < len; i++) {
+        c = src[i];
+        if (c >= 0x80 && !IS_LONE(c))
+            break;
+        if (d != NULL)
+            memcpy(d + o, byte_seq[c], BYTE_LEN(c));
+        o += BYTE_LEN(c);
+    }
+
+out:
+    *produced = o;
+    return i;
+}
+
+/*
+ * Decode the leading run of PUA sequences U+EF80..U+EFFF in $src of
+ * length $len to the binary bytes, up to $room bytes, and return the
+ * number of bytes decoded (i.e., a third of the input consumed); the
+ * output is only counted if $d is NULL.
+ */
+static inline size_t
+decode_pua(uint8_t *d, const uint8_t *src, size_t len, size_t room)
+{
+    const uint8_t *s;
+    size_t i;
+
+    for (s = src, i = 0; i < room && len - (size_t)(s - src) >= 3; i++) {
+        if (s[0] != 0xEE || (s[1] & 0xFE) != 0xBE || (s[2] & 0xC0) != 0x80)
+            break;
+        if (d != NULL)
+            d[i] = (uint8_t)(0x80 | (s[1] & 0x01) << 6 | (s[2] & 0x3F));
+        s += 3;
+    }
+
+    return i;
+}
+
+/*
+ * Call the engine $core specialized at compile time for whether to write
+ * the output ($dst is not NULL) and whether to abort on error, so that
+ * these modes are not tested again in the inner loop.  The remaining
+ * arguments are passed through.
+ */
+#define SPECIALIZE(core, dst, error, ...)                                 \
+    (((dst) != NULL) ?                                                    \
+     (((error) == XTF8_ERR_ABORT) ? core(true, true, __VA_ARGS__) :       \
+                                    core(true, false, __VA_ARGS__)) :     \
+     (((error) == XTF8_ERR_ABORT) ? core(false, true, __VA_ARGS__) :      \
+                                    core(false, false, __VA_ARGS__)))
+
+/*
+ * Return the length of the longest part of $n bytes at $s that fits in
+ * $room bytes and ends at a code point boundary.  The $n bytes must be
+ * valid UTF-8 sequences.
+ */
+static inline size_t
+fit_boundary(const uint8_t *s, size_t n, size_t room)
+{
+    if (n <= room)
+        return n;
+
+    n = room;
+    while (n > 0 && (s[n] & 0xC0) == 0x80)
+        n--;
+    return n;
+}
+
+
+/*
+ * Return the length of byte $ch after JSON escaping (RFC 8259, Section 7).
+ */
+static inline size_t
+json_esclen(uint8_t ch)
+{
+    if (ch <= 0x1F) {
+        switch (ch) {
+        case '\n':
+        case '\r':
+        case '\t':
+        case '\b':
+        case '\f':
+            return 2;
+        default:
+            return sizeof("\\u00XX") - 1;
+        }
+    }
+    return (ch == '\\' || ch == '"') ? 2 : 1;
+}
+
+/*
+ * Write the JSON-escaped byte $ch to $d, and return the new end.
+ *
+ * Credit: Nginx: src/core/ngx_string.c: ngx_escape_json()
+ */
+static inline uint8_t *
+json_put(uint8_t *d, uint8_t ch)
+{
+    if (ch <= 0x1F) {
+        *d++ = '\\';
+
+        switch (ch) {
+        case '\n':
+            *d++ = 'n';
+            break;
+        case '\r':
+            *d++ = 'r';
+            break;
+        case '\t':
+            *d++ = 't';
+            break;
+        case '\b':
+            *d++ = 'b';
+            break;
+        case '\f':
+            *d++ = 'f';
+            break;
+
+        default: /* u00XX */
+            *d++ = 'u';
+            *d++ = '0';
+            *d++ = '0';
+            *d++ = (uint8_t)('0' + (ch >> 4));
+            ch &= 0xF;
+            *d++ = (uint8_t)((ch < 10) ? ('0' + ch) : ('A' + ch - 10));
+        }
+
+    } else {
+        if (ch == '\\' || ch == '"')
+            *d++ = '\\';
+        *d++ = ch;
+    }
+
+    return d;
+}
+
+/*
+ * Copy the $n bytes of valid UTF-8 sequences at $s to $d (if not NULL)
+ * with JSON escaping, without exceeding $room bytes of output.  Return
+ * the number of bytes consumed, which ends at a code point boundary,
+ * and save the output size in $outlen.
+ */
+static size_t
+json_copy(uint8_t *d, const uint8_t *s, size_t n, size_t room,
+          size_t *outlen)
+{
+    size_t i, k, m, out, esc;
+
+    i = out = 0;
+
+    while (i < n) {
+        /* Bulk copy the bytes needing no escaping. */
+        k = xtf8_simd_get()->json(s + i, n - i);
+        while (i + k < n && json_esclen(s[i + k]) == 1)
+            k++;
+        m = fit_boundary(s + i, k, room - out);
+        if (d != NULL) {
+            memcpy(d + out, s + i, m);
+        }
+        i += m;
+        out += m;
+        if (m < k || i == n)
+            break;
+
+        esc = json_esclen(s[i]);
+        if (room - out < esc)
+            break;
+        if (d != NULL)
+            (void)json_put(d + out, s[i]);
+        i++;
+        out += esc;
+    }
+
+    *outlen = out;
+    return i;
+}
+
+
+/*
+ * The encoding engine shared by all the encoding interfaces.
+ *
+ * Encode $src of length $len into $dst of capacity $cap, or only count
+ * the output size if $write is false (with $cap = SIZE_MAX).  The process
+ * always starts at a code point boundary, and stops at a code point
+ * boundary when the output buffer is full.  An incomplete sequence at
+ * the end of $src is left unconsumed unless $final is true.  If $json
+ * is true, the output is also JSON escaped.
+ *
+ * The number of bytes consumed and produced are saved in $consumed and
+ * $produced, and return one of the RUN_* status.
+ */
+static XTF8_INLINE int
+encode_core(bool write, bool abort, bool json, void *dst, size_t cap,
+            const void *src, size_t len, bool final,
+            size_t *consumed, size_t *produced, struct xtf8_stats *stats)
 {
     uint32_t s_prev, s_cur, codepoint;
-    const uint8_t *s, *pos;
-    uint8_t *d, *end;
-    size_t sz;
+    const uint8_t *s, *pos, *fast, *end;
+    uint8_t *d;
+    size_t n, esc, sz;
+    int status;
 
     s_prev = s_cur = UTF8_ACCEPT;
     d = dst;
-    pos = s = src;
-    end = (uint8_t *)src + len;
+    fast = pos = s = src;
+    end = (const uint8_t *)src + len;
     sz = 0;
+    status = RUN_DONE;
 
     while (s < end) {
+        if (s_cur == UTF8_ACCEPT && IS_LONE(*s)) {
+            /* Binary data; expand the bytes via the table. */
+            n = (size_t)(end - s);
+            if (n > (cap - sz) / 3)
+                n = (cap - sz) / 3;
+            n = encode_lone(write ? d : NULL, s, n, !json, &esc);
+            if (n == 0) {
+                status = RUN_FULL;
+                goto out;
+            }
+            /* Every binary byte takes 3 bytes, and the text as is. */
+            DPRINTF("Encoded %zu binary bytes", (esc - n) / 2);
+            sz += esc;
+            STAT_ADD(stats, binary, (esc - n) / 2);
+            STAT_ADD(stats, passthrough, n - (esc - n) / 2);
+            if (write)
+                d += esc;
+            pos = s += n;
+            continue;
+        }
+
+        if (s_cur == UTF8_ACCEPT && s >= fast) {
+            /* Bulk copy the valid UTF-8 sequences ahead. */
+            n = passthrough(s, (size_t)(end - s));
+            if (n == 0) {
+                fast = s + XTF8_FAST_BACKOFF;
+            } else {
+                if (json) {
+                    n = json_copy(write ? d : NULL, s, n, cap - sz, &esc);
+                } else {
+                    n = esc = fit_boundary(s, n, cap - sz);
+                    if (write)
+                        memcpy(d, s, n);
+                }
+                if (n == 0) {
+                    status = RUN_FULL;
+                    goto out;
+                }
+                sz += esc;
+                if (write)
+                    d += esc;
+                STAT_ADD(stats, passthrough, n);
+                pos = s += n;
+                continue;
+            }
+        }
+
         switch (utf8_decode(&s_cur, &codepoint, *s)) {
 
         case UTF8_ACCEPT:
             if (codepoint >= XTF8_PUA_START && codepoint <= XTF8_PUA_END) {
                 /* Found a collision! */
-                if (error == XTF8_ERR_ABORT)
-                    return XTF8_ABORTED;
+                if (abort) {
+                    status = RUN_ABORT;
+                    goto out;
+                }
+                if (cap - sz < 3) {
+                    status = RUN_FULL;
+                    goto out;
+                }
 
                 /* Replace with the Unicode Replacement Character. */
                 codepoint = 0xFFFD; /* UTF-8: <EF BF BD> */
                 DPRINTF("Replaced -> U+%04X", codepoint);
                 sz += 3;
-                if (d != NULL) {
-                    *d++ = (codepoint >> 12 & 0x0F) | 0xE0;
-                    *d++ = (codepoint >> 6  & 0x3F) | 0x80;
-                    *d++ = (codepoint       & 0x3F) | 0x80;
+                STAT_ADD(stats, collisions, 1);
+                if (write)
+                    PUT3(d, codepoint);
+
+            } else if (json && s == pos) {
+                /* ASCII character, which may need escaping. */
+                DPRINTF("U+%04X", codepoint);
+                n = json_esclen(*s);
+                if (cap - sz < n) {
+                    status = RUN_FULL;
+                    goto out;
                 }
+                sz += n;
+                if (write)
+                    d = json_put(d, *s);
+                STAT_ADD(stats, passthrough, 1);
 
             } else {
                 /* Valid UTF-8 sequence, copy it. */
                 DPRINTF("U+%04X", codepoint);
-                sz += (size_t)(1 + s - pos);
-                if (d != NULL) {
-                    while (pos <= s)
-                        *d++ = *pos++;
+                n = (size_t)(1 + s - pos);
+                if (cap - sz < n) {
+                    status = RUN_FULL;
+                    goto out;
                 }
+                sz += n;
+                if (write)
+                    d = copy_seq(d, pos, n);
+                STAT_ADD(stats, passthrough, n);
             }
 
             pos = s + 1;
@@ -129,20 +715,25 @@ xtf8_encode(void *dst, const void *src, size_t len, int error)
             if (s_prev != UTF8_ACCEPT)
                 s--; /* Retry with this byte as the beginning. */
 
+            if (cap - sz < (size_t)(1 + s - pos) * 3) {
+                status = RUN_FULL;
+                goto out;
+            }
+
             /*
              * Every invalid byte is transliterated to a Unicode character
              * of range U+EF80..U+EFFF within the Private User Area (PUA),
              * which is encoded to 3 bytes in UTF-8 sequence.
              */
+            STAT_ADD(stats, binary, (size_t)(1 + s - pos));
             while (pos <= s) {
                 assert(*pos >= 0x80); /* Must be non-ASCII characters. */
+                DPRINTF("Encoded 0x%02x -> U+%04X", *pos,
+                        0xEF80 | (*pos & 0x7F));
                 sz += 3;
-                if (d != NULL) {
-                    codepoint = 0xEF80 | (*pos & 0x7F);
-                    DPRINTF("Encoded 0x%02x -> U+%04X", *pos, codepoint);
-                    *d++ = (codepoint >> 12 & 0x0F) | 0xE0;
-                    *d++ = (codepoint >> 6  & 0x3F) | 0x80;
-                    *d++ = (codepoint       & 0x3F) | 0x80;
+                if (write) {
+                    memcpy(d, byte_seq[*pos], 3);
+                    d += 3;
                 }
                 pos++;
             }
@@ -159,31 +750,109 @@ xtf8_encode(void *dst, const void *src, size_t len, int error)
         s++;
     }
 
-    if (d != NULL) {
-        assert((uint8_t *)dst + sz == d);
-        assert(is_utf8(dst, sz));
-        return (uintptr_t)d;
-    } else {
-        return (uintptr_t)sz;
+    if (pos < end && final) {
+        /* Truncated sequence at the end; encode to PUA as well. */
+        if (cap - sz < (size_t)(end - pos) * 3) {
+            status = RUN_FULL;
+            goto out;
+        }
+        STAT_ADD(stats, binary, (size_t)(end - pos));
+        while (pos < end) {
+            assert(*pos >= 0x80);
+            sz += 3;
+            if (write) {
+                memcpy(d, byte_seq[*pos], 3);
+                d += 3;
+            }
+            pos++;
+        }
     }
+
+out:
+    *consumed = (size_t)(pos - (const uint8_t *)src);
+    *produced = sz;
+    return status;
 }
 
 
-uintptr_t
-xtf8_decode(void *dst, const void *src, size_t len, int error)
+static int
+encode_run(void *dst, size_t cap, const void *src, size_t len, int error,
+           bool final, size_t *consumed, size_t *produced,
+           struct xtf8_stats *stats)
+{
+    return SPECIALIZE(encode_core, dst, error, false, dst, cap, src, len,
+                      final, consumed, produced, stats);
+}
+
+static int
+encode_json_run(void *dst, size_t cap, const void *src, size_t len,
+                int error, bool final, size_t *consumed, size_t *produced,
+                struct xtf8_stats *stats)
+{
+    return SPECIALIZE(encode_core, dst, error, true, dst, cap, src, len,
+                      final, consumed, produced, stats);
+}
+
+
+/*
+ * The decoding engine shared by all the decoding interfaces.
+ * See encode_core() for the parameters.
+ */
+static XTF8_INLINE int
+decode_core(bool write, bool abort, void *dst, size_t cap,
+            const void *src, size_t len, bool final,
+            size_t *consumed, size_t *produced, struct xtf8_stats *stats)
 {
     uint32_t s_prev, s_cur, codepoint;
-    const uint8_t *s, *pos;
-    uint8_t v, *d, *end;
-    size_t sz;
+    const uint8_t *s, *pos, *fast, *end;
+    uint8_t v, *d;
+    size_t n, sz;
+    int status;
 
     s_prev = s_cur = UTF8_ACCEPT;
     d = dst;
-    pos = s = src;
-    end = (uint8_t *)src + len;
+    fast = pos = s = src;
+    end = (const uint8_t *)src + len;
     sz = 0;
+    status = RUN_DONE;
 
     while (s < end) {
+        if (s_cur == UTF8_ACCEPT && *s == 0xEE) {
+            /* Run of encoded binary bytes; decode them directly. */
+            n = decode_pua(write ? d : NULL, s, (size_t)(end - s), cap - sz);
+            if (n > 0) {
+                DPRINTF("Decoded %zu binary bytes", n);
+                sz += n;
+                STAT_ADD(stats, binary, n);
+                if (write)
+                    d += n;
+                pos = s += n * 3;
+                continue;
+            }
+        }
+
+        if (s_cur == UTF8_ACCEPT && s >= fast) {
+            /* Bulk copy the valid UTF-8 sequences ahead. */
+            n = passthrough(s, (size_t)(end - s));
+            if (n == 0) {
+                fast = s + XTF8_FAST_BACKOFF;
+            } else {
+                n = fit_boundary(s, n, cap - sz);
+                if (n == 0) {
+                    status = RUN_FULL;
+                    goto out;
+                }
+                sz += n;
+                if (write) {
+                    memcpy(d, s, n);
+                    d += n;
+                }
+                STAT_ADD(stats, passthrough, n);
+                pos = s += n;
+                continue;
+            }
+        }
+
         switch (utf8_decode(&s_cur, &codepoint, *s)) {
 
         case UTF8_ACCEPT:
@@ -194,22 +863,31 @@ xtf8_decode(void *dst, const void *src, size_t len, int error)
                  * WARNING: Must decode the value to non-ASCII character
                  *          (i.e., 0x80..0xFF) to avoid security issues!
                  */
+                if (cap - sz < 1) {
+                    status = RUN_FULL;
+                    goto out;
+                }
                 v = (codepoint & 0x7F) | 0x80;
                 assert(v >= 0x80);
                 DPRINTF("Decoded U+%04X -> 0x%02x", codepoint, v);
                 sz += 1;
-                if (d != NULL) {
+                if (write) {
                     *d++ = v;
                 }
+                STAT_ADD(stats, binary, 1);
 
             } else {
                 /* Valid UTF-8 sequence, copy it. */
                 DPRINTF("U+%04X", codepoint);
-                sz += (size_t)(1 + s - pos);
-                if (d != NULL) {
-                    while (pos <= s)
-                        *d++ = *pos++;
+                n = (size_t)(1 + s - pos);
+                if (cap - sz < n) {
+                    status = RUN_FULL;
+                    goto out;
                 }
+                sz += n;
+                if (write)
+                    d = copy_seq(d, pos, n);
+                STAT_ADD(stats, passthrough, n);
             }
 
             pos = s + 1;
@@ -217,8 +895,14 @@ xtf8_decode(void *dst, const void *src, size_t len, int error)
 
         case UTF8_REJECT:
             /* Invalid UTF-8 sequence! */
-            if (error == XTF8_ERR_ABORT)
-                return XTF8_ABORTED;
+            if (abort) {
+                status = RUN_ABORT;
+                goto out;
+            }
+            if (cap - sz < 3) {
+                status = RUN_FULL;
+                goto out;
+            }
 
             s_cur = UTF8_ACCEPT;
             if (s_prev != UTF8_ACCEPT)
@@ -228,11 +912,9 @@ xtf8_decode(void *dst, const void *src, size_t len, int error)
             codepoint = 0xFFFD; /* UTF-8: <EF BF BD> */
             DPRINTF("Replaced -> U+%04X", codepoint);
             sz += 3;
-            if (d != NULL) {
-                *d++ = (codepoint >> 12 & 0x0F) | 0xE0;
-                *d++ = (codepoint >> 6  & 0x3F) | 0x80;
-                *d++ = (codepoint       & 0x3F) | 0x80;
-            }
+            if (write)
+                PUT3(d, codepoint);
+            STAT_ADD(stats, invalid, 1);
 
             pos = s + 1;
             break;
@@ -246,10 +928,1307 @@ xtf8_decode(void *dst, const void *src, size_t len, int error)
         s++;
     }
 
-    if (d != NULL) {
-        assert((uint8_t *)dst + sz == d);
-        return (uintptr_t)d;
+    if (pos < end && final) {
+        /* Truncated sequence at the end. */
+        if (abort) {
+            status = RUN_ABORT;
+            goto out;
+        }
+        if (cap - sz < 3) {
+            status = RUN_FULL;
+            goto out;
+        }
+        codepoint = 0xFFFD;
+        DPRINTF("Replaced -> U+%04X", codepoint);
+        sz += 3;
+        if (write)
+            PUT3(d, codepoint);
+        STAT_ADD(stats, invalid, 1);
+        pos = end;
+    }
+
+out:
+    *consumed = (size_t)(pos - (const uint8_t *)src);
+    *produced = sz;
+    return status;
+}
+
+
+static int
+decode_run(void *dst, size_t cap, const void *src, size_t len, int error,
+           bool final, size_t *consumed, size_t *produced,
+           struct xtf8_stats *stats)
+{
+    return SPECIALIZE(decode_core, dst, error, dst, cap, src, len,
+                      final, consumed, produced, stats);
+}
+
+
+/*
+ * Write the UTF-8 sequence of code point $cp to $d (if not NULL), and
+ * return its length.
+ */
+static inline size_t
+put_utf8(uint8_t *d, uint32_t cp)
+{
+    if (cp < 0x80) {
+        if (d != NULL)
+            d[0] = (uint8_t)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        if (d != NULL) {
+            d[0] = (uint8_t)((cp >> 6) | 0xC0);
+            d[1] = (uint8_t)((cp & 0x3F) | 0x80);
+        }
+        return 2;
+    } else if (cp < 0x10000) {
+        if (d != NULL) {
+            d[0] = (uint8_t)((cp >> 12) | 0xE0);
+            d[1] = (uint8_t)((cp >> 6 & 0x3F) | 0x80);
+            d[2] = (uint8_t)((cp & 0x3F) | 0x80);
+        }
+        return 3;
     } else {
-        return (uintptr_t)sz;
+        if (d != NULL) {
+            d[0] = (uint8_t)((cp >> 18) | 0xF0);
+            d[1] = (uint8_t)((cp >> 12 & 0x3F) | 0x80);
+            d[2] = (uint8_t)((cp >> 6 & 0x3F) | 0x80);
+            d[3] = (uint8_t)((cp & 0x3F) | 0x80);
+        }
+        return 4;
+    }
+}
+
+
+/*
+ * Return the length of the leading part of $s (of length $n) that has
+ * no reverse solidus or quotation mark.
+ */
+static size_t
+json_scan(const uint8_t *s, size_t n)
+{
+    size_t i, stop;
+
+    i = 0;
+    while (i < n) {
+        i += xtf8_simd_get()->json(s + i, n - i);
+
+        /* The kernel also stops at control characters; check here. */
+        stop = (n - i > XTF8_SCALAR_RUN) ? i + XTF8_SCALAR_RUN : n;
+        for (; i < stop; i++) {
+            if (s[i] == '\\' || s[i] == '"')
+                return i;
+        }
+    }
+
+    return n;
+}
+
+
+/*
+ * Parse the 4 hex digits at $s into $v, and return whether succeeded.
+ * Both uppercase and lowercase are accepted.
+ */
+static inline bool
+json_hex4(const uint8_t *s, uint32_t *v)
+{
+    uint8_t ch;
+    int i;
+
+    for (*v = 0, i = 0; i < 4; i++) {
+        ch = s[i];
+        if (ch >= '0' && ch <= '9')
+            ch = (uint8_t)(ch - '0');
+        else if (ch >= 'A' && ch <= 'F')
+            ch = (uint8_t)(ch - 'A' + 10);
+        else if (ch >= 'a' && ch <= 'f')
+            ch = (uint8_t)(ch - 'a' + 10);
+        else
+            return false;
+        *v = (*v << 4) | ch;
     }
+
+    return true;
+}
+
+/* Return values of json_parse_escape() besides the sequence length */
+#define JSON_INCOMPLETE ((size_t)0)
+#define JSON_INVALID    ((size_t)-1)
+
+/* Code point of a lone surrogate, which is not valid in UTF-8 */
+#define JSON_LONE       UINT32_MAX
+
+/*
+ * Parse the JSON escape sequence at $s (i.e., the reverse solidus) up
+ * to $end, and save the code point in $cp, or JSON_LONE for a lone
+ * surrogate.  Surrogate pairs (e.g., \uD83D\uDE00) are combined.
+ *
+ * Return the length of the sequence, JSON_INCOMPLETE if more bytes are
+ * needed (unless $final), or JSON_INVALID.
+ */
+static size_t
+json_parse_escape(const uint8_t *s, const uint8_t *end, bool final,
+                  uint32_t *cp)
+{
+    uint32_t lo;
+
+    if (end - s < 2)
+        return final ? JSON_INVALID : JSON_INCOMPLETE;
+
+    switch (s[1]) {
+    case '"':  *cp = '"';  return 2;
+    case '\\': *cp = '\\'; return 2;
+    case '/':  *cp = '/';  return 2;
+    case 'b':  *cp = '\b'; return 2;
+    case 'f':  *cp = '\f'; return 2;
+    case 'n':  *cp = '\n'; return 2;
+    case 'r':  *cp = '\r'; return 2;
+    case 't':  *cp = '\t'; return 2;
+    case 'u':
+        break;
+    default:
+        DPRINTF("invalid escape sequence: %.*s", 2, s);
+        return JSON_INVALID;
+    }
+
+    if (end - s < 6)
+        return final ? JSON_INVALID : JSON_INCOMPLETE;
+    if (!json_hex4(s + 2, cp)) {
+        DPRINTF("invalid xdigit in \\uXXXX sequence: %.*s", 6, s);
+        return JSON_INVALID;
+    }
+
+    if (*cp >= 0xDC00 && *cp <= 0xDFFF) {
+        *cp = JSON_LONE;
+        return 6;
+    }
+    if (*cp < 0xD800 || *cp > 0xDBFF)
+        return 6;
+
+    /* High surrogate; must be followed by a low surrogate. */
+    if (end - s < 12) {
+        /* Decide as soon as the following bytes can't be a pair. */
+        if ((end - s > 6 && s[6] != '\\') || (end - s > 7 && s[7] != 'u') ||
+            final) {
+            *cp = JSON_LONE;
+            return 6;
+        }
+        return JSON_INCOMPLETE;
+    }
+    if (s[6] != '\\' || s[7] != 'u' || !json_hex4(s + 8, &lo) ||
+        lo < 0xDC00 || lo > 0xDFFF) {
+        *cp = JSON_LONE;
+        return 6;
+    }
+
+    *cp = 0x10000 + ((*cp - 0xD800) << 10) + (lo - 0xDC00);
+    return 12;
+}
+
+
+/*
+ * The engine of JSON unescaping and XTF8 decoding in one pass.
+ * See encode_run() for the parameters.
+ *
+ * The unescaped runs are decoded by decode_run(), while the escaped
+ * characters are decoded directly, e.g., \uEF80 to byte 0x80.  Invalid
+ * JSON escape sequences and unescaped quotation marks always abort.
+ */
+static int
+decode_json_run(void *dst, size_t cap, const void *src, size_t len,
+                int error, bool final, size_t *consumed, size_t *produced,
+                struct xtf8_stats *stats)
+{
+    const uint8_t *s, *end;
+    uint8_t *d;
+    uint32_t cp;
+    size_t k, n, nin, nout, sz;
+    int status;
+    bool lone;
+
+    d = dst;
+    s = src;
+    end = (const uint8_t *)src + len;
+    sz = 0;
+    status = RUN_DONE;
+
+    while (s < end) {
+        k = json_scan(s, (size_t)(end - s));
+        if (k > 0) {
+            /* An escape ends any incomplete sequence before it. */
+            status = decode_run(d, cap - sz, s, k, error,
+                                (k < (size_t)(end - s) || final),
+                                &nin, &nout, stats);
+            s += nin;
+            sz += nout;
+            if (d != NULL)
+                d += nout;
+            if (status != RUN_DONE || nin < k)
+                goto out;
+        }
+        if (s == end)
+            break;
+
+        if (*s == '"') {
+            DPRINTF("%s", "unescaped quotation mark");
+            status = RUN_ABORT;
+            goto out;
+        }
+
+        k = json_parse_escape(s, end, final, &cp);
+        if (k == JSON_INCOMPLETE)
+            goto out;
+        if (k == JSON_INVALID) {
+            status = RUN_ABORT;
+            goto out;
+        }
+
+        lone = (cp == JSON_LONE);
+        if (lone) {
+            /* Not valid in UTF-8, same as invalid sequences. */
+            if (error == XTF8_ERR_ABORT) {
+                status = RUN_ABORT;
+                goto out;
+            }
+            cp = 0xFFFD;
+            DPRINTF("Replaced -> U+%04X", cp);
+        } else if (cp >= XTF8_PUA_START && cp <= XTF8_PUA_END) {
+            /* Decode to non-ASCII byte, see decode_run(). */
+            if (cap - sz < 1) {
+                status = RUN_FULL;
+                goto out;
+            }
+            DPRINTF("Decoded \\u%04X -> 0x%02x", cp, (cp & 0x7F) | 0x80);
+            sz += 1;
+            if (d != NULL)
+                *d++ = (uint8_t)((cp & 0x7F) | 0x80);
+            STAT_ADD(stats, binary, 1);
+            s += k;
+            continue;
+        }
+
+        n = put_utf8(NULL, cp);
+        if (cap - sz < n) {
+            status = RUN_FULL;
+            goto out;
+        }
+        sz += n;
+        if (d != NULL)
+            d += put_utf8(d, cp);
+        if (lone)
+            STAT_ADD(stats, invalid, 1);
+        else
+            STAT_ADD(stats, passthrough, k);
+        s += k;
+    }
+
+out:
+    *consumed = (size_t)(s - (const uint8_t *)src);
+    *produced = sz;
+    return status;
+}
+
+
+uintptr_t
+xtf8_encode(void *dst, const void *src, size_t len, int error)
+{
+    return xtf8_encode_stats(dst, src, len, error, NULL);
+}
+
+
+uintptr_t
+xtf8_encode_stats(void *dst, const void *src, size_t len, int error,
+                  struct xtf8_stats *stats)
+{
+    size_t consumed, sz;
+
+    if (encode_run(dst, SIZE_MAX, src, len, error, true,
+                   &consumed, &sz, stats) == RUN_ABORT)
+        return XTF8_ABORTED;
+
+    assert(consumed == len);
+    if (dst != NULL) {
+        assert(is_utf8(dst, sz));
+        return (uintptr_t)((uint8_t *)dst + sz);
+    } else {
+        return (uintptr_t)sz;
+    }
+}
+
+
+uintptr_t
+xtf8_encode_json(void *dst, const void *src, size_t len, int error)
+{
+    size_t consumed, sz;
+
+    if (encode_json_run(dst, SIZE_MAX, src, len, error, true,
+                        &consumed, &sz, NULL) == RUN_ABORT)
+        return XTF8_ABORTED;
+
+    assert(consumed == len);
+    if (dst != NULL) {
+        assert(is_utf8(dst, sz));
+        return (uintptr_t)((uint8_t *)dst + sz);
+    } else {
+        return (uintptr_t)sz;
+    }
+}
+
+
+uintptr_t
+xtf8_decode(void *dst, const void *src, size_t len, int error)
+{
+    return xtf8_decode_stats(dst, src, len, error, NULL);
+}
+
+
+uintptr_t
+xtf8_decode_stats(void *dst, const void *src, size_t len, int error,
+                  struct xtf8_stats *stats)
+{
+    size_t consumed, sz;
+
+    if (decode_run(dst, SIZE_MAX, src, len, error, true,
+                   &consumed, &sz, stats) == RUN_ABORT)
+        return XTF8_ABORTED;
+
+    assert(consumed == len);
+    if (dst != NULL)
+        return (uintptr_t)((uint8_t *)dst + sz);
+    else
+        return (uintptr_t)sz;
+}
+
+
+uintptr_t
+xtf8_decode_json(void *dst, const void *src, size_t len, int error)
+{
+    size_t consumed, sz;
+
+    if (decode_json_run(dst, SIZE_MAX, src, len, error, true,
+                        &consumed, &sz, NULL) == RUN_ABORT)
+        return XTF8_ABORTED;
+
+    assert(consumed == len);
+    if (dst != NULL)
+        return (uintptr_t)((uint8_t *)dst + sz);
+    else
+        return (uintptr_t)sz;
+}
+
+
+
+/*
+ * Convert the internal RUN_* status to the values of the partial API.
+ */
+static int
+partial_status(int status)
+{
+    switch (status) {
+    case RUN_DONE:
+        return 0;
+    case RUN_FULL:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+
+int
+xtf8_encode_partial(void *dst, size_t dstcap, const void *src,
+                    size_t srclen, int error,
+                    size_t *consumed, size_t *produced)
+{
+    int status;
+
+    status = encode_run(dst, dstcap, src, srclen, error, true,
+                        consumed, produced, NULL);
+    assert(status != RUN_DONE || *consumed == srclen);
+    assert(status == RUN_ABORT || dst == NULL || is_utf8(dst, *produced));
+    return partial_status(status);
+}
+
+
+int
+xtf8_decode_partial(void *dst, size_t dstcap, const void *src,
+                    size_t srclen, int error,
+                    size_t *consumed, size_t *produced)
+{
+    int status;
+
+    status = decode_run(dst, dstcap, src, srclen, error, true,
+                        consumed, produced, NULL);
+    assert(status != RUN_DONE || *consumed == srclen);
+    return partial_status(status);
+}
+
+
+uintptr_t
+xtf8_decode_size(const void *src, size_t len, int error)
+{
+    const uint8_t *s, *end;
+    size_t n, npua, run, consumed, sz, total;
+    bool final;
+
+    s = src;
+    end = s + len;
+    run = XTF8_SCALAR_RUN;
+    total = 0;
+
+    while (s < end) {
+        /* Valid UTF-8 blocks; every PUA sequence decodes to 1 byte. */
+        npua = 0;
+        n = xtf8_simd_get()->utf8(s, (size_t)(end - s), &npua);
+        total += n - npua * 2;
+        s += n;
+        if (s == end)
+            break;
+
+        /*
+         * Count the troublesome part with the DFA, in growing runs while
+         * the kernel makes no progress (e.g., the scalar one).
+         */
+        run = (n > 0) ? XTF8_SCALAR_RUN : run * 2;
+        n = (size_t)(end - s);
+        final = (n <= run);
+        if (!final)
+            n = run;
+        if (decode_run(NULL, SIZE_MAX, s, n, error, final,
+                       &consumed, &sz, NULL) == RUN_ABORT)
+            return XTF8_ABORTED;
+        total += sz;
+        s += consumed;
+    }
+
+    assert(total == xtf8_decode(NULL, src, len, error));
+    return (uintptr_t)total;
+}
+
+
+int
+xtf8_validate(const void *src, size_t len, size_t *offset, size_t *npua)
+{
+    const uint8_t *s, *end, *stop;
+    uint32_t codepoint;
+    size_t n, count;
+
+    s = src;
+    end = s + len;
+    count = 0;
+
+    while (s < end) {
+        s += xtf8_simd_get()->utf8(s, (size_t)(end - s), &count);
+
+        /*
+         * Check the next run by whole sequences, which either finds the
+         * error or gets past the block the kernel stopped at.
+         */
+        stop = (end - s > XTF8_SCALAR_RUN) ? s + XTF8_SCALAR_RUN : end;
+        while (s < stop) {
+            n = utf8_next(s, (size_t)(end - s), &codepoint);
+            if (n == 0)
+                goto out;
+            if (codepoint >= XTF8_PUA_START && codepoint <= XTF8_PUA_END)
+                count++;
+            s += n;
+        }
+    }
+
+out:
+    assert((s == end) == is_utf8(src, len));
+    if (offset != NULL)
+        *offset = (size_t)(s - (const uint8_t *)src);
+    if (npua != NULL)
+        *npua = count;
+    return (s == end) ? 0 : -1;
+}
+
+
+uintptr_t
+xtf8_decode_inplace(void *buf, size_t len, int error)
+{
+    uint8_t tmp[4096], *d, *s, *end;
+    size_t n, consumed, sz;
+    bool final;
+
+    /* No replacements to grow the data, if it's valid. */
+    if (error != XTF8_ERR_ABORT &&
+        xtf8_decode_size(buf, len, XTF8_ERR_ABORT) == XTF8_ABORTED)
+        return XTF8_ABORTED;
+
+    d = s = buf;
+    end = s + len;
+
+    while (s < end) {
+        /* Leading part that needs no change, moved down as a whole. */
+        n = passthrough(s, (size_t)(end - s));
+        if (d != s)
+            memmove(d, s, n);
+        d += n;
+        s += n;
+        if (s == end)
+            break;
+
+        /*
+         * Decode the next block via the small buffer, whose output is
+         * never longer than the input consumed, so it's never ahead of
+         * the data yet to read.
+         */
+        n = (size_t)(end - s);
+        final = (n <= sizeof(tmp));
+        if (!final)
+            n = sizeof(tmp);
+        if (decode_run(tmp, sizeof(tmp), s, n, XTF8_ERR_ABORT, final,
+                       &consumed, &sz, NULL) == RUN_ABORT)
+            return XTF8_ABORTED;
+        assert(sz <= consumed);
+        memcpy(d, tmp, sz);
+        d += sz;
+        s += consumed;
+    }
+
+    return (uintptr_t)d;
+}
+
+
+size_t
+xtf8_scan(const void *src, size_t len)
+{
+    return passthrough(src, len);
+}
+
+void
+xtf8_stream_init(xtf8_stream_t *ctx, int error)
+{
+    ctx->error = error;
+    ctx->len = 0;
+    ctx->stats = NULL;
+}
+
+void
+xtf8_stream_stats(xtf8_stream_t *ctx, struct xtf8_stats *stats)
+{
+    ctx->stats = stats;
+}
+
+
+typedef int (*run_func)(void *, size_t, const void *, size_t, int, bool,
+                        size_t *, size_t *, struct xtf8_stats *);
+
+/*
+ * Run the engine $f over the pending bytes and then the new data in
+ * $src of length $len.  See xtf8_stream_encode().
+ */
+static int
+stream_run(xtf8_stream_t *ctx, run_func f, void *dst, size_t dstcap,
+           const void *src, size_t len, bool final,
+           size_t *consumed, size_t *produced)
+{
+    uint8_t tmp[sizeof(ctx->buf) * 2];
+    const uint8_t *s;
+    uint8_t *d;
+    size_t n, nin, nout, tlen;
+    int status;
+
+    s = src;
+    d = dst;
+    *consumed = *produced = 0;
+
+    while (ctx->len > 0) {
+        /*
+         * Complete the pending sequence with some new bytes, which
+         * are enough to either finish or reject the sequence.
+         */
+        n = (len < sizeof(ctx->buf)) ? len : sizeof(ctx->buf);
+        memcpy(tmp, ctx->buf, ctx->len);
+        if (n > 0)
+            memcpy(tmp + ctx->len, s, n);
+        tlen = ctx->len + n;
+
+        status = f(d, dstcap, tmp, tlen, ctx->error, (final && n == len),
+                   &nin, &nout, ctx->stats);
+        *produced += nout;
+        if (d != NULL)
+            d += nout;
+        dstcap -= nout;
+
+        if (nin == 0) {
+            if (status != RUN_DONE)
+                return status;
+
+            /* Still incomplete; all the new bytes became pending. */
+            assert(n == len && !final);
+            assert(tlen <= sizeof(ctx->buf));
+            memcpy(ctx->buf, tmp, tlen);
+            ctx->len = (unsigned int)tlen;
+            *consumed += len;
+            return RUN_DONE;
+        }
+
+        if (nin < ctx->len) {
+            /*
+             * Only part of the pending bytes were consumed (e.g., a raw
+             * sequence before an incomplete JSON escape); keep the rest
+             * and try again.
+             */
+            ctx->len -= (unsigned int)nin;
+            memmove(ctx->buf, ctx->buf + nin, ctx->len);
+            if (status != RUN_DONE)
+                return status;
+            continue;
+        }
+
+        s += nin - ctx->len;
+        len -= nin - ctx->len;
+        *consumed += nin - ctx->len;
+        ctx->len = 0;
+        if (status != RUN_DONE || len == 0)
+            return status;
+    }
+
+    if (len == 0)
+        return RUN_DONE;
+
+    status = f(d, dstcap, s, len, ctx->error, final, &nin, &nout,
+               ctx->stats);
+    *consumed += nin;
+    *produced += nout;
+
+    if (status == RUN_DONE && nin < len) {
+        /* Keep the incomplete sequence at the end. */
+        assert(len - nin <= sizeof(ctx->buf));
+        memcpy(ctx->buf, s + nin, len - nin);
+        ctx->len = (unsigned int)(len - nin);
+        *consumed += len - nin;
+    }
+
+    return status;
+}
+
+
+/*
+ * Convert the internal RUN_* status to the values of the stream API.
+ */
+static int
+stream_status(int status)
+{
+    return (status == RUN_ABORT) ? -1 : 0;
+}
+
+
+int
+xtf8_stream_encode(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                   const void *src, size_t srclen,
+                   size_t *consumed, size_t *produced)
+{
+    return stream_status(stream_run(ctx, encode_run, dst, dstcap,
+                                    src, srclen, false,
+                                    consumed, produced));
+}
+
+
+int
+xtf8_stream_encode_json(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                        const void *src, size_t srclen,
+                        size_t *consumed, size_t *produced)
+{
+    return stream_status(stream_run(ctx, encode_json_run, dst, dstcap,
+                                    src, srclen, false,
+                                    consumed, produced));
+}
+
+
+int
+xtf8_stream_decode(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                   const void *src, size_t srclen,
+                   size_t *consumed, size_t *produced)
+{
+    return stream_status(stream_run(ctx, decode_run, dst, dstcap,
+                                    src, srclen, false,
+                                    consumed, produced));
+}
+
+
+int
+xtf8_stream_decode_json(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                        const void *src, size_t srclen,
+                        size_t *consumed, size_t *produced)
+{
+    return stream_status(stream_run(ctx, decode_json_run, dst, dstcap,
+                                    src, srclen, false,
+                                    consumed, produced));
+}
+
+
+/*
+ * Flush the pending bytes with the engine $f.
+ */
+static int
+stream_flush(xtf8_stream_t *ctx, run_func f, void *dst, size_t dstcap,
+             size_t *produced)
+{
+    size_t consumed;
+    int status;
+
+    status = stream_run(ctx, f, dst, dstcap, NULL, 0, true,
+                        &consumed, produced);
+    if (status == RUN_ABORT)
+        return -1;
+    return (ctx->len > 0) ? 1 : 0;
+}
+
+
+int
+xtf8_stream_encode_flush(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                         size_t *produced)
+{
+    return stream_flush(ctx, encode_run, dst, dstcap, produced);
+}
+
+
+int
+xtf8_stream_decode_flush(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                         size_t *produced)
+{
+    return stream_flush(ctx, decode_run, dst, dstcap, produced);
+}
+
+
+int
+xtf8_stream_decode_json_flush(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                              size_t *produced)
+{
+    return stream_flush(ctx, decode_json_run, dst, dstcap, produced);
+}
+
+
+
+/*
+ * A chunk of the input processed by one thread of the parallel codec.
+ */
+struct parallel_job {
+    run_func f;
+    int error;
+    const uint8_t *src;
+    size_t len;
+    uint8_t *dst; /* NULL to only get the output size */
+    size_t size;
+    int status;
+};
+
+static void *
+parallel_work(void *arg)
+{
+    struct parallel_job *job = arg;
+    size_t consumed;
+
+    job->status = job->f(job->dst, SIZE_MAX, job->src, job->len,
+                         job->error, true, &consumed, &job->size, NULL);
+    assert(job->status == RUN_ABORT || consumed == job->len);
+    return NULL;
+}
+
+/*
+ * Run the $n jobs concurrently, with the first one in the calling thread.
+ * Return false if any job aborted.
+ */
+static bool
+parallel_run_jobs(struct parallel_job *jobs, unsigned int n)
+{
+    pthread_t tids[XTF8_PARALLEL_MAX];
+    bool started[XTF8_PARALLEL_MAX];
+    unsigned int i;
+    bool ok;
+
+    for (i = 1; i < n; i++) {
+        started[i] = (pthread_create(&tids[i], NULL, parallel_work,
+                                     &jobs[i]) == 0);
+    }
+    parallel_work(&jobs[0]);
+
+    ok = true;
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                parallel_work(&jobs[i]); /* fall back to this thread */
+        }
+        if (jobs[i].status == RUN_ABORT)
+            ok = false;
+    }
+
+    return ok;
+}
+
+/*
+ * The parallel codec with the engine $f; see xtf8_encode_parallel().
+ *
+ * The input is split at the non-continuation bytes, where the engines
+ * always restart from the initial state: the bytes before either form
+ * complete sequences or are rejected (and then the engine retries the
+ * byte as a beginning), which is the same as the handling of a truncated
+ * sequence at the end of the final input.  So the chunks can be encoded
+ * independently and the concatenated output is identical to the serial
+ * one.  The output sizes are computed concurrently first, so that every
+ * thread can then write its part in place.
+ */
+static uintptr_t
+parallel(run_func f, void *dst, const void *src, size_t len, int error,
+         unsigned int nthreads)
+{
+    struct parallel_job jobs[XTF8_PARALLEL_MAX];
+    const uint8_t *s;
+    size_t start, stop, off;
+    unsigned int i, n;
+
+    s = src;
+    n = (nthreads < XTF8_PARALLEL_MAX) ? nthreads : XTF8_PARALLEL_MAX;
+    if (n > len / XTF8_PARALLEL_CHUNK)
+        n = (unsigned int)(len / XTF8_PARALLEL_CHUNK);
+    if (n == 0)
+        n = 1;
+
+    for (start = 0, i = 0; i < n; i++) {
+        stop = (i == n - 1) ? len : len / n * (i + 1);
+        if (stop < start)
+            stop = start;
+        while (stop < len && (s[stop] & 0xC0) == 0x80)
+            stop++;
+
+        jobs[i].f = f;
+        jobs[i].error = error;
+        jobs[i].src = s + start;
+        jobs[i].len = stop - start;
+        jobs[i].dst = NULL;
+        start = stop;
+    }
+
+    if (!parallel_run_jobs(jobs, n))
+        return XTF8_ABORTED;
+
+    for (off = 0, i = 0; i < n; i++)
+        off += jobs[i].size;
+    if (dst == NULL)
+        return (uintptr_t)off;
+
+    for (off = 0, i = 0; i < n; i++) {
+        jobs[i].dst = (uint8_t *)dst + off;
+        off += jobs[i].size;
+    }
+    if (!parallel_run_jobs(jobs, n))
+        return XTF8_ABORTED; /* not reached */
+
+    return (uintptr_t)((uint8_t *)dst + off);
+}
+
+
+uintptr_t
+xtf8_encode_parallel(void *dst, const void *src, size_t len, int error,
+                     unsigned int nthreads)
+{
+    uintptr_t end;
+
+    end = parallel(encode_run, dst, src, len, error, nthreads);
+    assert(dst == NULL || end == XTF8_ABORTED ||
+           is_utf8(dst, (size_t)(end - (uintptr_t)dst)));
+    return end;
+}
+
+
+uintptr_t
+xtf8_decode_parallel(void *dst, const void *src, size_t len, int error,
+                     unsigned int nthreads)
+{
+    return parallel(decode_run, dst, src, len, error, nthreads);
+}
+
+
+/*
+ * The batch codec with the engine $f; see xtf8_encode_batch().
+ */
+static uintptr_t
+batch(run_func f, void *dst, const struct xtf8_span *spans, size_t n,
+      size_t *offsets, int error)
+{
+    uint8_t *d;
+    size_t i, consumed, sz, off;
+
+    d = dst;
+    for (off = 0, i = 0; i < n; i++) {
+        offsets[i] = off;
+        if (f(d, SIZE_MAX, spans[i].ptr, spans[i].len, error, true,
+              &consumed, &sz, NULL) == RUN_ABORT)
+            return XTF8_ABORTED;
+        assert(consumed == spans[i].len);
+        off += sz;
+        if (d != NULL)
+            d += sz;
+    }
+    offsets[n] = off;
+
+    return (dst != NULL) ? (uintptr_t)d : (uintptr_t)off;
+}
+
+
+uintptr_t
+xtf8_encode_batch(void *dst, const struct xtf8_span *spans, size_t n,
+                  size_t *offsets, int error)
+{
+    return batch(encode_run, dst, spans, n, offsets, error);
+}
+
+
+uintptr_t
+xtf8_decode_batch(void *dst, const struct xtf8_span *spans, size_t n,
+                  size_t *offsets, int error)
+{
+    return batch(decode_run, dst, spans, n, offsets, error);
+}
+
+uintptr_t
+xtf8_index_build(struct xtf8_checkpoint *index, size_t n, const void *src,
+                 size_t len, size_t interval, int error)
+{
+    const uint8_t *s, *stop, *end;
+    uint64_t decoded;
+    uintptr_t sz;
+    size_t k;
+
+    if (interval < 16)
+        interval = 16;
+
+    s = src;
+    end = s + len;
+    decoded = 0;
+    k = 0;
+
+    while (s < end) {
+        if (index != NULL && k < n) {
+            index[k].decoded = decoded;
+            index[k].encoded = (uint64_t)(s - (const uint8_t *)src);
+        }
+        k++;
+
+        /*
+         * Split at a non-continuation byte, where the decoder restarts
+         * from the initial state anyway (see parallel()), so the pieces
+         * can be sized independently.
+         */
+        stop = ((size_t)(end - s) > interval) ? s + interval : end;
+        while (stop < end && (*stop & 0xC0) == 0x80)
+            stop++;
+
+        sz = xtf8_decode_size(s, (size_t)(stop - s), error);
+        if (sz == XTF8_ABORTED)
+            return XTF8_ABORTED;
+        decoded += sz;
+        s = stop;
+    }
+
+    return (uintptr_t)k;
+}
+
+
+uintptr_t
+xtf8_decode_range(void *dst, const void *src, size_t len,
+                  const struct xtf8_checkpoint *index, size_t n,
+                  uint64_t offset, size_t count, int error)
+{
+    const uint8_t *s, *end;
+    uint8_t tmp[64], *d;
+    uint64_t cur, stop, lo, hi;
+    size_t i, j, m, nin, nout;
+    int status;
+
+    d = dst;
+    s = src;
+    end = s + len;
+    cur = 0;
+    stop = (count > UINT64_MAX - offset) ? UINT64_MAX : offset + count;
+
+    /* The last checkpoint not beyond $offset */
+    for (i = 0, j = n; i < j; ) {
+        m = i + (j - i) / 2;
+        if (index[m].decoded <= offset)
+            i = m + 1;
+        else
+            j = m;
+    }
+    if (i > 0) {
+        if (index[i - 1].encoded > len)
+            return XTF8_ABORTED;
+        s += index[i - 1].encoded;
+        cur = index[i - 1].decoded;
+    }
+
+    while (cur < stop && s < end) {
+        if (cur < offset) {
+            /* Skip to the range without writing. */
+            status = decode_run(NULL, ((offset - cur > SIZE_MAX) ?
+                                       SIZE_MAX : (size_t)(offset - cur)),
+                                s, (size_t)(end - s), error, true,
+                                &nin, &nout, NULL);
+        } else {
+            /* Inside the range; decode straight into $dst. */
+            status = decode_run(d, (size_t)(stop - cur), s,
+                                (size_t)(end - s), error, true,
+                                &nin, &nout, NULL);
+            d += nout;
+        }
+        if (status == RUN_ABORT)
+            return XTF8_ABORTED;
+        s += nin;
+        cur += nout;
+        if (nin > 0)
+            continue;
+
+        /*
+         * The next code point straddles a range boundary; decode it
+         * (with a few more) via the small buffer, and take the part
+         * inside the range.
+         */
+        status = decode_run(tmp, sizeof(tmp), s, (size_t)(end - s), error,
+                            true, &nin, &nout, NULL);
+        if (status == RUN_ABORT)
+            return XTF8_ABORTED;
+        lo = (cur < offset) ? offset - cur : 0;
+        hi = (stop - cur < nout) ? stop - cur : nout;
+        if (lo < hi) {
+            memcpy(d, tmp + lo, (size_t)(hi - lo));
+            d += hi - lo;
+        }
+        s += nin;
+        cur += nout;
+    }
+
+    return (uintptr_t)d;
+}
+
+
+/*
+ * Write the code point $cp to $d (if not NULL) as UTF-16 code units, and
+ * return the number of units.
+ */
+static inline size_t
+put_utf16(uint16_t *d, uint32_t cp)
+{
+    if (cp < 0x10000) {
+        if (d != NULL)
+            d[0] = (uint16_t)cp;
+        return 1;
+    }
+
+    cp -= 0x10000;
+    if (d != NULL) {
+        d[0] = (uint16_t)(0xD800 | cp >> 10);
+        d[1] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+    }
+    return 2;
+}
+
+/*
+ * The UTF-16 code unit of the PUA code point that encodes the binary
+ * byte $c (0x80..0xFF).
+ */
+#define PUA_UNIT(c)     ((uint16_t)(XTF8_PUA_START | ((c) & 0x7F)))
+
+
+uintptr_t
+xtf8_encode_utf16(uint16_t *dst, const void *src, size_t len, int error)
+{
+    uint32_t s_prev, s_cur, codepoint;
+    const uint8_t *s, *pos, *end;
+    uint16_t *d;
+    size_t n, k, sz;
+
+    s_prev = s_cur = UTF8_ACCEPT;
+    d = dst;
+    pos = s = src;
+    end = s + len;
+    sz = 0;
+
+    while (s < end) {
+        if (s_cur == UTF8_ACCEPT) {
+            /* ASCII and binary bytes are one code unit each. */
+            if (d != NULL) {
+                n = xtf8_simd_get()->widen(d, s, (size_t)(end - s));
+                d += n;
+            } else {
+                n = xtf8_simd_get()->ascii(s, (size_t)(end - s));
+            }
+            sz += n;
+            s += n;
+            for (; s < end && (*s < 0x80 || IS_LONE(*s)); s++, sz++) {
+                if (d != NULL)
+                    *d++ = (*s < 0x80) ? *s : PUA_UNIT(*s);
+            }
+            pos = s;
+            if (s == end)
+                break;
+
+            /* Valid sequence, decoded in one step. */
+            k = utf8_next(s, (size_t)(end - s), &codepoint);
+            if (k > 0 && (codepoint < XTF8_PUA_START ||
+                          codepoint > XTF8_PUA_END)) {
+                n = put_utf16(d, codepoint);
+                sz += n;
+                if (d != NULL)
+                    d += n;
+                pos = s += k;
+                continue;
+            }
+        }
+
+        switch (utf8_decode(&s_cur, &codepoint, *s)) {
+
+        case UTF8_ACCEPT:
+            if (codepoint >= XTF8_PUA_START && codepoint <= XTF8_PUA_END) {
+                /* Found a collision! */
+                if (error == XTF8_ERR_ABORT)
+                    return XTF8_ABORTED;
+                codepoint = 0xFFFD;
+                DPRINTF("Replaced -> U+%04X", codepoint);
+            }
+            n = put_utf16(d, codepoint);
+            sz += n;
+            if (d != NULL)
+                d += n;
+            pos = s + 1;
+            break;
+
+        case UTF8_REJECT:
+            /* Invalid UTF-8 sequence; encode to PUA. */
+            s_cur = UTF8_ACCEPT;
+            if (s_prev != UTF8_ACCEPT)
+                s--; /* Retry with this byte as the beginning. */
+            for (; pos <= s; pos++, sz++) {
+                assert(*pos >= 0x80);
+                if (d != NULL)
+                    *d++ = PUA_UNIT(*pos);
+            }
+            break;
+
+        default:
+            /* More bytes to read. */
+            break;
+        }
+
+        s_prev = s_cur;
+        s++;
+    }
+
+    /* Truncated sequence at the end; encode to PUA as well. */
+    for (; pos < end; pos++, sz++) {
+        assert(*pos >= 0x80);
+        if (d != NULL)
+            *d++ = PUA_UNIT(*pos);
+    }
+
+    return (dst != NULL) ? (uintptr_t)d : (uintptr_t)sz;
+}
+
+
+uintptr_t
+xtf8_decode_utf16(void *dst, const uint16_t *src, size_t len, int error)
+{
+    const uint16_t *s, *end;
+    uint8_t *d;
+    uint32_t cp;
+    size_t n, sz;
+
+    d = dst;
+    s = src;
+    end = src + len;
+    sz = 0;
+
+    while (s < end) {
+        if (d != NULL) {
+            n = xtf8_simd_get()->narrow(d, s, (size_t)(end - s));
+            d += n;
+            s += n;
+            sz += n;
+        }
+        for (; s < end && *s < 0x80; s++, sz++) {
+            if (d != NULL)
+                *d++ = (uint8_t)*s;
+        }
+        if (s == end)
+            break;
+
+        cp = *s++;
+        if (cp >= XTF8_PUA_START && cp <= XTF8_PUA_END) {
+            /* Decode to non-ASCII byte, see decode_run(). */
+            DPRINTF("Decoded U+%04X -> 0x%02x", cp, (cp & 0x7F) | 0x80);
+            sz += 1;
+            if (d != NULL)
+                *d++ = (uint8_t)((cp & 0x7F) | 0x80);
+            continue;
+        }
+
+        if (cp >= 0xD800 && cp <= 0xDFFF) {
+            if (cp <= 0xDBFF && s < end && *s >= 0xDC00 && *s <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) +
+                     (uint32_t)(*s++ - 0xDC00);
+            } else {
+                /* Lone surrogate; not valid in UTF-8. */
+                if (error == XTF8_ERR_ABORT)
+                    return XTF8_ABORTED;
+                cp = 0xFFFD;
+                DPRINTF("Replaced -> U+%04X", cp);
+            }
+        }
+
+        n = put_utf8(d, cp);
+        sz += n;
+        if (d != NULL)
+            d += n;
+    }
+
+    return (dst != NULL) ? (uintptr_t)d : (uintptr_t)sz;
+}
+
+
+size_t
+xtf8_encode_bound(size_t len)
+{
+    return (len > SIZE_MAX / 3) ? SIZE_MAX : len * 3;
+}
+
+
+size_t
+xtf8_encode_json_bound(size_t len)
+{
+    return (len > SIZE_MAX / 6) ? SIZE_MAX : len * 6;
+}
+
+
+size_t
+xtf8_decode_bound(size_t len)
+{
+    return (len > SIZE_MAX / 3) ? SIZE_MAX : len * 3;
+}
+
+
+size_t
+xtf8_encode_utf16_bound(size_t len)
+{
+    return len;
+}
+
+
+size_t
+xtf8_decode_utf16_bound(size_t len)
+{
+    return (len > SIZE_MAX / 3) ? SIZE_MAX : len * 3;
+}
+
+
+const char *
+xtf8_kernel(void)
+{
+    if (xtf8_simd_get()->name == NULL)
+        xtf8_simd_init();
+    return xtf8_simd_get()->name;
 }
@@ -45,7 +45,9 @@ enum {
  * $dst, and return a pointer to the end of the used $dst buffer.
  *
  * The required output buffer size can be obtained by calling with
- * $dst = NULL.
+ * $dst = NULL.  Alternatively, allocate a buffer of the size given by
+ * xtf8_encode_bound() and encode in a single pass; the output length is
+ * then the returned pointer minus $dst.
  *
  * If error occurred, then return XTF8_ABORTED.
  *
@@ -55,13 +57,25 @@ enum {
  */
 uintptr_t xtf8_encode(void *dst, const void *src, size_t len, int error);
 
+/*
+ * Same as xtf8_encode(), but also escape the result to be a valid JSON
+ * string (RFC 8259, Section 7) in the same pass.  The surrounding
+ * quotation marks are not added.
+ *
+ * Use xtf8_encode_json_bound() to get the maximum output size.
+ */
+uintptr_t xtf8_encode_json(void *dst, const void *src, size_t len,
+                           int error);
+
 /*
  * Decode the given data in $src of length $len, place the result in
  * $dst, and return a pointer to the end of the used $dst buffer.
  *
- * The required output buffer size can be obtained by calling with
- * $dst = NULL, but it's easier to just allocate a buffer of the same
- * size as the input.
+ * The exact output size can be obtained quickly by xtf8_decode_size(),
+ * or by calling with $dst = NULL; but it's easier to just allocate a
+ * buffer of the size given by xtf8_decode_bound() and decode in a single
+ * pass.  A buffer of the same size as the input is enough with
+ * XTF8_ERR_ABORT.
  *
  * If error occurred, then return XTF8_ABORTED.
  *
@@ -71,5 +85,357 @@ uintptr_t xtf8_encode(void *dst, const void *src, size_t len, int error);
  */
 uintptr_t xtf8_decode(void *dst, const void *src, size_t len, int error);
 
+/*
+ * Counters of what the codec did to the data, which are only added to,
+ * so they sum up over calls and must be zeroed by the caller first.
+ */
+struct xtf8_stats {
+    size_t passthrough; /* input bytes of valid UTF-8 copied (or escaped) */
+    size_t binary;      /* binary bytes encoded to or decoded from PUA */
+    size_t collisions;  /* PUA code points replaced with U+FFFD (encode) */
+    size_t invalid;     /* invalid sequences replaced with U+FFFD (decode) */
+};
+
+/*
+ * Same as xtf8_encode() and xtf8_decode(), but also add the statistics
+ * to $stats if it's not NULL.  The counters are only touched where the
+ * data is changed or copied in bulk, so they cost little; and nothing
+ * more than a test of $stats when it's NULL.
+ *
+ * Use xtf8_stream_stats() to collect the statistics of the streaming
+ * functions, including the JSON ones.
+ */
+uintptr_t xtf8_encode_stats(void *dst, const void *src, size_t len,
+                            int error, struct xtf8_stats *stats);
+uintptr_t xtf8_decode_stats(void *dst, const void *src, size_t len,
+                            int error, struct xtf8_stats *stats);
+
+/*
+ * Encode/decode the data in $src of length $srclen into $dst of capacity
+ * $dstcap, stopping at a code point boundary when $dst is full.  The
+ * number of bytes consumed from $src is saved in $consumed, and the
+ * number of bytes written to $dst is saved in $produced.
+ *
+ * Unlike the stream API, no state is kept between the calls: $src is the
+ * whole remaining input, so a truncated sequence at its end is handled
+ * as by xtf8_encode()/xtf8_decode().  Calling again with the rest of the
+ * input gives the same output in pieces, so it can be written directly
+ * into fixed-size buffers (e.g., ring buffers and iovecs).  A buffer of
+ * 12 bytes always has room for the next code point.
+ *
+ * Return 0 if all the input is consumed, 1 if $dst is full, or -1 if
+ * aborted due to the XTF8_ERR_ABORT error handler, with $consumed and
+ * $produced indicating the error location.
+ */
+int xtf8_encode_partial(void *dst, size_t dstcap, const void *src,
+                        size_t srclen, int error,
+                        size_t *consumed, size_t *produced);
+int xtf8_decode_partial(void *dst, size_t dstcap, const void *src,
+                        size_t srclen, int error,
+                        size_t *consumed, size_t *produced);
+
+/*
+ * Return the exact output size of xtf8_decode() for the given data in
+ * $src of length $len with the error handler $error, or XTF8_ABORTED if
+ * the decoding would be aborted.
+ *
+ * This is much faster than calling xtf8_decode() with $dst = NULL: the
+ * vectorized kernel validates the data and counts the encoded values in
+ * one sweep, and only the invalid parts go through the DFA.
+ */
+uintptr_t xtf8_decode_size(const void *src, size_t len, int error);
+
+/*
+ * Check whether the data in $src of length $len is valid UTF-8, which is
+ * also valid XTF8 encoded data that decodes without errors.
+ *
+ * Return 0 if valid, or -1 if not.  The offset of the first invalid (or
+ * truncated) sequence, or $len if valid, is saved in $offset; and the
+ * number of code points in the XTF8 encoding area (U+EF80..U+EFFF), i.e.,
+ * the encoded values, before it is saved in $npua.  Either can be NULL.
+ *
+ * The data is checked by the vectorized kernel with lookup tables at
+ * about the memory bandwidth, and only the invalid parts go through the
+ * DFA to locate the error.
+ */
+int xtf8_validate(const void *src, size_t len, size_t *offset,
+                  size_t *npua);
+
+/*
+ * Decode the data in $buf of length $len in place, and return a pointer
+ * to the end of the decoded data in $buf.
+ *
+ * The data never grows with XTF8_ERR_ABORT, since every encoded value
+ * (3 bytes) is decoded to 1 byte and the rest is copied unchanged.  If
+ * aborted, XTF8_ABORTED is returned and the content of $buf is
+ * unspecified.
+ *
+ * With XTF8_ERR_REPLACE, the replacements may grow the data, so
+ * XTF8_ABORTED is returned with $buf unchanged if there are any invalid
+ * sequences; then xtf8_decode_size() gives the required size to decode
+ * into another buffer.
+ */
+uintptr_t xtf8_decode_inplace(void *buf, size_t len, int error);
+
+/*
+ * Return the offset of the first byte in $src of length $len that would
+ * be changed by xtf8_encode() or xtf8_decode(), or $len if the data is
+ * returned unchanged by both, i.e., it is valid UTF-8 without any code
+ * points in the XTF8 encoding area (U+EF80..U+EFFF).
+ *
+ * The returned offset is at a character boundary, so the caller can copy
+ * the leading part verbatim and only encode/decode the rest, or just use
+ * the input as is if nothing needs to be changed.
+ */
+size_t xtf8_scan(const void *src, size_t len);
+
+/*
+ * Same as xtf8_encode() and xtf8_decode(), but process the data with up
+ * to $nthreads threads for large inputs; the output is identical.
+ *
+ * The data is split into chunks of at least 1 MiB at character
+ * boundaries, the output size of every chunk is computed concurrently,
+ * and then every thread writes its part of the output in place.  So
+ * this costs about twice the total CPU time of the serial functions.
+ */
+uintptr_t xtf8_encode_parallel(void *dst, const void *src, size_t len,
+                               int error, unsigned int nthreads);
+uintptr_t xtf8_decode_parallel(void *dst, const void *src, size_t len,
+                               int error, unsigned int nthreads);
+
+/*
+ * A string to process with the batch functions.
+ */
+struct xtf8_span {
+    const void *ptr;
+    size_t len;
+};
+
+/*
+ * Encode/decode the $n strings in $spans one after another into $dst,
+ * and return a pointer to the end of the used $dst buffer, or
+ * XTF8_ABORTED if any of them failed.
+ *
+ * The result of the i-th string is at $offsets[i] of length
+ * ($offsets[i+1] - $offsets[i]), so $offsets must have ($n + 1) elements.
+ * The output size is bounded by xtf8_encode_bound()/xtf8_decode_bound()
+ * of the total input length.  Same as xtf8_encode(), the required output
+ * size (and offsets) can be obtained with $dst = NULL.
+ */
+uintptr_t xtf8_encode_batch(void *dst, const struct xtf8_span *spans,
+                            size_t n, size_t *offsets, int error);
+uintptr_t xtf8_decode_batch(void *dst, const struct xtf8_span *spans,
+                            size_t n, size_t *offsets, int error);
+
+/*
+ * Encode the given data in $src of length $len straight to UTF-16 code
+ * units (in native byte order) in $dst, with the same rules and error
+ * handlers as xtf8_encode(), i.e., the OPTU-16 encoding (optu8to16).
+ * Return a pointer to the end of the used $dst buffer, or the number of
+ * code units needed if $dst is NULL, or XTF8_ABORTED on error.
+ *
+ * The output never exceeds $len code units (see
+ * xtf8_encode_utf16_bound()).
+ */
+uintptr_t xtf8_encode_utf16(uint16_t *dst, const void *src, size_t len,
+                            int error);
+
+/*
+ * Decode the UTF-16 code units in $src of length $len (in native byte
+ * order) to the original hybrid data in $dst, as xtf8_decode() does:
+ * the code points U+EF80..U+EFFF are decoded to the binary bytes, and
+ * the others are converted to UTF-8.  Lone surrogates are handled as
+ * invalid sequences by the $error handler.  Return a pointer to the end
+ * of the used $dst buffer, or the size needed if $dst is NULL, or
+ * XTF8_ABORTED on error.
+ *
+ * The output never exceeds xtf8_decode_utf16_bound($len) bytes.
+ */
+uintptr_t xtf8_decode_utf16(void *dst, const uint16_t *src, size_t len,
+                            int error);
+
+/*
+ * A checkpoint of the random-access index of XTF8 encoded data: the
+ * decoding can start at the $encoded offset, which corresponds to the
+ * $decoded offset of the original data.
+ */
+struct xtf8_checkpoint {
+    uint64_t decoded;
+    uint64_t encoded;
+};
+
+/*
+ * Build the index of the encoded data in $src of length $len, with a
+ * checkpoint about every $interval bytes (at least 16) of it, starting
+ * with the one at offset 0.  Up to $n checkpoints are saved in $index,
+ * which can be NULL to only count them; and at most ($len / $interval
+ * + 1) are needed.
+ *
+ * Return the number of checkpoints, or XTF8_ABORTED if the data is
+ * invalid with XTF8_ERR_ABORT.  The index is only valid for decoding
+ * with the same $error handler.
+ */
+uintptr_t xtf8_index_build(struct xtf8_checkpoint *index, size_t n,
+                           const void *src, size_t len, size_t interval,
+                           int error);
+
+/*
+ * Decode the $count bytes at $offset of the original data from its
+ * encoded data in $src of length $len, into $dst that has room for
+ * $count bytes; and return a pointer to the end of the used $dst buffer,
+ * which is short if the data ends before, or XTF8_ABORTED on error.
+ *
+ * The decoding starts at the last checkpoint not beyond $offset in the
+ * $n checkpoints of $index (from xtf8_index_build()), so it costs about
+ * $count plus the index interval instead of $offset.  Without an index
+ * ($n = 0), it starts from the beginning.
+ */
+uintptr_t xtf8_decode_range(void *dst, const void *src, size_t len,
+                            const struct xtf8_checkpoint *index, size_t n,
+                            uint64_t offset, size_t count, int error);
+
+/*
+ * Return the maximum output size of encoding/decoding $len bytes, which
+ * is $len * 3 for both: every binary byte is encoded to a 3-byte code
+ * point, and every invalid byte may be replaced with U+FFFD (3 bytes).
+ *
+ * Return SIZE_MAX if the bound overflows, so that allocation fails.
+ */
+size_t xtf8_encode_bound(size_t len);
+size_t xtf8_decode_bound(size_t len);
+
+/*
+ * Return the maximum output size of xtf8_encode_utf16() for $len bytes,
+ * which is $len code units; and of xtf8_decode_utf16() for $len code
+ * units, which is $len * 3 bytes (or SIZE_MAX if it overflows).
+ */
+size_t xtf8_encode_utf16_bound(size_t len);
+size_t xtf8_decode_utf16_bound(size_t len);
+
+/*
+ * Return the maximum output size of xtf8_encode_json() for $len bytes,
+ * which is $len * 6 because a control character is escaped as \u00XX.
+ */
+size_t xtf8_encode_json_bound(size_t len);
+
+/*
+ * Unescape the given JSON string (RFC 8259, Section 7) in $src of length
+ * $len, without the surrounding quotation marks, and decode the result
+ * in the same pass, as xtf8_decode() after a JSON unescaping.
+ *
+ * All the JSON escape sequences are supported, including the surrogate
+ * pairs, and the escaped code points in the XTF8 encoding area (e.g.,
+ * \uEF80) are decoded to the binary bytes directly.  Lone surrogates are
+ * handled as invalid sequences by the $error handler.
+ *
+ * Return XTF8_ABORTED on error, also if found an invalid JSON escape
+ * sequence or an unescaped quotation mark regardless of $error.
+ *
+ * The output is never larger than xtf8_decode_bound($len), or $len with
+ * XTF8_ERR_ABORT.
+ */
+uintptr_t xtf8_decode_json(void *dst, const void *src, size_t len,
+                           int error);
+
+/*
+ * Return the name of the vectorized kernel selected for the running CPU,
+ * e.g., "avx512bw", "avx2", "ssse3", "sse2", "neon", or "scalar".
+ *
+ * The kernel is selected when the library is loaded, and can be forced
+ * to a lesser one by setting the environment variable XTF8_KERNEL to its
+ * name.
+ */
+const char *xtf8_kernel(void);
+
+
+/*
+ * Streaming codec context.
+ *
+ * The context carries the error handler, the statistics to collect if
+ * any, and the pending bytes of an incomplete UTF-8 sequence (or JSON
+ * escape sequence) at the end of the previous chunk, which also
+ * determine the DFA state, so that the data can be processed chunk by
+ * chunk in constant memory, and the result is the same as processing
+ * the whole data at once.
+ *
+ * The members are private; use the following functions only.
+ */
+typedef struct xtf8_stream {
+    int error;
+    unsigned int len;
+    unsigned char buf[12];
+    struct xtf8_stats *stats;
+} xtf8_stream_t;
+
+/*
+ * Initialize the context $ctx with the error handler $error.
+ * The same context must be used for only one direction.
+ */
+void xtf8_stream_init(xtf8_stream_t *ctx, int error);
+
+/*
+ * Collect the statistics of the subsequent calls with $ctx into $stats,
+ * or stop collecting if $stats is NULL (the default).
+ */
+void xtf8_stream_stats(xtf8_stream_t *ctx, struct xtf8_stats *stats);
+
+/*
+ * Encode/decode the chunk $src of length $srclen, and place the result
+ * in $dst of capacity $dstcap.  The number of bytes consumed from $src
+ * is saved in $consumed, and the number of bytes written to $dst is
+ * saved in $produced.
+ *
+ * The process stops at a code point boundary when $dst is full, in
+ * which case $consumed is less than $srclen, and the caller should call
+ * again with the remaining data after draining $dst.  A buffer of
+ * xtf8_encode_bound($srclen + 12) bytes is always enough.
+ *
+ * An incomplete sequence at the end of $src is kept in the context and
+ * counted as consumed.
+ *
+ * Return 0 on success, or -1 if aborted due to the XTF8_ERR_ABORT error
+ * handler, with $consumed and $produced indicating the error location.
+ */
+int xtf8_stream_encode(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                       const void *src, size_t srclen,
+                       size_t *consumed, size_t *produced);
+int xtf8_stream_decode(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                       const void *src, size_t srclen,
+                       size_t *consumed, size_t *produced);
+
+/*
+ * Same as xtf8_stream_encode(), but also JSON escape the result as
+ * xtf8_encode_json() does.  A buffer of xtf8_encode_json_bound($srclen
+ * + 12) bytes is always enough.  Finish the stream with
+ * xtf8_stream_encode_flush(), since the pending bytes never need
+ * escaping.
+ */
+int xtf8_stream_encode_json(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                            const void *src, size_t srclen,
+                            size_t *consumed, size_t *produced);
+
+/*
+ * Same as xtf8_stream_decode(), but JSON unescape the input first as
+ * xtf8_decode_json() does.  Finish the stream with the dedicated
+ * xtf8_stream_decode_json_flush().
+ */
+int xtf8_stream_decode_json(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                            const void *src, size_t srclen,
+                            size_t *consumed, size_t *produced);
+
+/*
+ * Finish the stream by flushing the pending bytes to $dst of capacity
+ * $dstcap, which needs at most 9 bytes to encode and 3 bytes to decode.
+ *
+ * Return 0 on success, 1 if $dst is too small (call again with more
+ * space), or -1 if aborted.
+ */
+int xtf8_stream_encode_flush(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                             size_t *produced);
+int xtf8_stream_decode_flush(xtf8_stream_t *ctx, void *dst, size_t dstcap,
+                             size_t *produced);
+int xtf8_stream_decode_json_flush(xtf8_stream_t *ctx, void *dst,
+                                  size_t dstcap, size_t *produced);
+
 
 #endif
@@ -28,13 +28,59 @@ XTF8 LuaJIT FFI interface.
 
 API
 ---
-encoded = xtf8.encode(data, err?)
-decoded = xtf8.decode(data, err?)
+encoded = xtf8.encode(data, err?, offset?, length?)
+encoded = xtf8.encode(ptr, len, err?)
+decoded = xtf8.decode(data, err?, offset?, length?)
+decoded = xtf8.decode(ptr, len, err?)
+escaped = xtf8.encode_json(data, err?, offset?, length?)
+escaped = xtf8.encode_json(ptr, len, err?)
+decoded = xtf8.decode_json(escaped, err?, offset?, length?)
+decoded = xtf8.decode_json(ptr, len, err?)
+n = xtf8.encode_into(sbuf, <input>)
+n = xtf8.encode_into(ptr, len, <input>)
+n = xtf8.decode_into(sbuf, <input>)
+n = xtf8.decode_into(ptr, len, <input>)
+encoded_tbl = xtf8.encode_many(tbl, err?)
+decoded_tbl = xtf8.decode_many(tbl, err?)
+kernel = xtf8.kernel()
+xtf8.set_buffer(max_size?, shrink_after?)
 
 The 'err' parameter is optional, and can have the following values:
 - xtf8.ERR_REPLACE : replace conflicting characters (default)
 - xtf8.ERR_ABORT : terminate the encoding process
 
+The encode_json() function encodes the data and escapes the result to
+be a valid JSON string (without the surrounding quotes) in one pass;
+and the decode_json() function does the reverse.
+
+The input is either the string 'data', or its slice selected by the
+optional 'offset' (1-based, default 1) and 'length' (default: to the
+end) parameters as data:sub(offset, offset + length - 1) but without
+creating that string; or the memory at cdata 'ptr' of 'len' bytes,
+e.g., a request body buffer or shared memory.
+
+The encode() and decode() functions return the original string if
+nothing needs to be changed.
+
+The encode_into() and decode_into() functions take the input in either
+form above after the destination, append the result to the
+string.buffer 'sbuf' (LuaJIT 2.1), or write it to the memory at cdata
+'ptr' of size 'len', without creating a Lua string; and return the
+number of bytes written.  If the memory is too small, they return nil,
+"buffer too small", and the required size.
+
+The encode_many() and decode_many() functions process all the strings
+in the array 'tbl' in one call, and return a new array of the results.
+
+The kernel() function returns the name of the vectorized kernel in use
+(e.g., "avx2").
+
+The set_buffer() function configures the internal scratch buffer used
+by the functions returning strings: the maximum size to keep (default
+1 MiB), beyond which a temporary buffer is used; and the number of
+consecutive calls using less than a quarter of the buffer after which
+it is shrunk (default 256).
+
 Usage
 -----
 local xtf8 = require("xtf8")
@@ -92,55 +138,316 @@ enum {
 // #define XTF8_ABORTED    (uintptr_t)-1;
 
 uintptr_t xtf8_encode(void *dst, const void *src, size_t len, int error);
+uintptr_t xtf8_encode_json(void *dst, const void *src, size_t len, int error);
 uintptr_t xtf8_decode(void *dst, const void *src, size_t len, int error);
+uintptr_t xtf8_decode_json(void *dst, const void *src, size_t len, int error);
+uintptr_t xtf8_decode_size(const void *src, size_t len, int error);
+size_t xtf8_scan(const void *src, size_t len);
+
+struct xtf8_span {
+    const void *ptr;
+    size_t len;
+};
+uintptr_t xtf8_encode_batch(void *dst, const struct xtf8_span *spans,
+                            size_t n, size_t *offsets, int error);
+uintptr_t xtf8_decode_batch(void *dst, const struct xtf8_span *spans,
+                            size_t n, size_t *offsets, int error);
+size_t xtf8_encode_bound(size_t len);
+size_t xtf8_encode_json_bound(size_t len);
+size_t xtf8_decode_bound(size_t len);
+const char *xtf8_kernel(void);
 ]]
 
 -- NOTE: Cannot just use 'ffi.cast("uintptr_t", -1)' because it is undefined.
 -- See: https://github.com/LuaJIT/LuaJIT/issues/459
 local xtf8_aborted = ffi.cast("uintptr_t", ffi.typeof("int")(-1))
 
+local _str_type = ffi.typeof("const unsigned char *")
+local _ptr_type = ffi.typeof("unsigned char *")
+
 
-local get_buffer
+-- Scratch output buffer, which grows as needed up to a cap and is kept
+-- across calls to avoid GC pressure.  Once grown, it is shrunk again
+-- after many consecutive calls that need less than a quarter of it.
+local get_buffer, set_buffer
 do
     local _buf_type = ffi.typeof("unsigned char[?]")
-    local _buf_size = 4096
-    local _buf
+    local _min_size = 4096
+    local _max_size = 1024 * 1024 -- larger ones are not kept
+    local _shrink_after = 256 -- number of small calls before shrinking
+    local _buf, _buf_size = nil, 0
+    local _small = 0
+
+    local function alloc(size)
+        _buf = ffi.new(_buf_type, size)
+        _buf_size = size
+        _small = 0
+    end
 
     function get_buffer(size)
-        if size > _buf_size then
+        if size > _max_size then
             return ffi.new(_buf_type, size)
         end
-        if not _buf then
-            _buf = ffi.new(_buf_type, _buf_size)
+
+        if size > _buf_size then
+            local n = (_buf_size > 0) and _buf_size or _min_size
+            while n < size do
+                n = n * 2
+            end
+            alloc(math.min(n, _max_size))
+        elseif _buf_size > _min_size and size <= _buf_size / 4 then
+            _small = _small + 1
+            if _small >= _shrink_after then
+                alloc(math.max(_buf_size / 4, _min_size))
+            end
+        else
+            _small = 0
         end
+
         return _buf
     end
+
+    function set_buffer(max_size, shrink_after)
+        _max_size = math.max(max_size or _max_size, _min_size)
+        _shrink_after = shrink_after or _shrink_after
+        if _buf_size > _max_size then
+            _buf, _buf_size = nil, 0
+        end
+    end
 end
 
 
-local function xtf8_encode(data, err)
-    err = err or xtf8.XTF8_ERR_REPLACE
-    local len = xtf8.xtf8_encode(nil, data, #data, err)
-    if len == xtf8_aborted then
+-- Get the input from the arguments, either (data, err?, offset?, length?)
+-- for the string or its slice, or (ptr, len, err?) for the memory at cdata.
+-- Return the pointer, the length, the error handler, and the string if
+-- it's the whole input.  The caller must keep 'data' referenced.
+local function get_input(data, a, b, c)
+    if type(data) == "cdata" then
+        local len = tonumber(a)
+        if not len or len < 0 then
+            error("bad argument #2 (length expected)", 3)
+        end
+        return ffi.cast(_str_type, data), len, b or xtf8.XTF8_ERR_REPLACE
+    end
+
+    if type(data) ~= "string" then
+        error("bad argument #1 (string or cdata expected)", 3)
+    end
+    local len = #data
+    local offset = b or 1
+    if offset < 1 or offset > len + 1 then
+        error("bad argument #3 (offset out of range)", 3)
+    end
+    local n = c or (len - offset + 1)
+    if n < 0 or n > len - offset + 1 then
+        error("bad argument #4 (length out of range)", 3)
+    end
+
+    return ffi.cast(_str_type, data) + (offset - 1), n,
+           a or xtf8.XTF8_ERR_REPLACE, (n == len) and data or nil
+end
+
+
+local function xtf8_encode(data, a, b, c)
+    local src, len, err, whole = get_input(data, a, b, c)
+    local skip = tonumber(xtf8.xtf8_scan(src, len))
+    if skip == len then
+        -- Nothing to change
+        return whole or ffi.string(src, len)
+    end
+
+    -- Copy the leading part that needs no change, and process the rest.
+    local buf = get_buffer(skip +
+                           tonumber(xtf8.xtf8_encode_bound(len - skip)))
+    ffi.copy(buf, src, skip)
+    local e = xtf8.xtf8_encode(buf + skip, src + skip, len - skip, err)
+    if e == xtf8_aborted then
         return nil, "found invalid sequence"
     end
 
-    local buf = get_buffer(len)
-    xtf8.xtf8_encode(buf, data, #data, err)
-    return ffi.string(buf, len)
+    return ffi.string(buf, tonumber(e - ffi.cast("uintptr_t", buf)))
 end
 
 
-local function xtf8_decode(data, err)
-    err = err or xtf8.XTF8_ERR_REPLACE
-    local len = xtf8.xtf8_decode(nil, data, #data, err)
-    if len == xtf8_aborted then
+local function xtf8_encode_json(data, a, b, c)
+    local src, len, err = get_input(data, a, b, c)
+    local buf = get_buffer(tonumber(xtf8.xtf8_encode_json_bound(len)))
+    local e = xtf8.xtf8_encode_json(buf, src, len, err)
+    if e == xtf8_aborted then
+        return nil, "found invalid sequence"
+    end
+
+    return ffi.string(buf, tonumber(e - ffi.cast("uintptr_t", buf)))
+end
+
+
+local function xtf8_decode(data, a, b, c)
+    local src, len, err, whole = get_input(data, a, b, c)
+    local skip = tonumber(xtf8.xtf8_scan(src, len))
+    if skip == len then
+        -- Nothing to change
+        return whole or ffi.string(src, len)
+    end
+
+    -- Copy the leading part that needs no change, and process the rest
+    -- into a buffer of the exact size.
+    local size = xtf8.xtf8_decode_size(src + skip, len - skip, err)
+    if size == xtf8_aborted then
+        return nil, "found invalid sequence"
+    end
+    local buf = get_buffer(skip + tonumber(size))
+    ffi.copy(buf, src, skip)
+    local e = xtf8.xtf8_decode(buf + skip, src + skip, len - skip, err)
+    if e == xtf8_aborted then
+        return nil, "found invalid sequence"
+    end
+
+    return ffi.string(buf, tonumber(e - ffi.cast("uintptr_t", buf)))
+end
+
+
+local function xtf8_decode_json(data, a, b, c)
+    local src, len, err = get_input(data, a, b, c)
+    local buf = get_buffer(tonumber(xtf8.xtf8_decode_bound(len)))
+    local e = xtf8.xtf8_decode_json(buf, src, len, err)
+    if e == xtf8_aborted then
         return nil, "found invalid sequence"
     end
 
-    local buf = get_buffer(len)
-    xtf8.xtf8_decode(buf, data, #data, err)
-    return ffi.string(buf, len)
+    return ffi.string(buf, tonumber(e - ffi.cast("uintptr_t", buf)))
+end
+
+
+-- Helper of the *_into() functions, with the arguments either
+-- (sbuf, <input>) or (ptr, len, <input>), where the input is taken by
+-- get_input().
+local function xtf8_into(f_xtf8, f_bound, dst, ...)
+    local cap, data, a, b, c
+    if type(dst) == "cdata" then
+        cap, data, a, b, c = ...
+        cap = tonumber(cap)
+    else
+        data, a, b, c = ...
+    end
+
+    local src, len, err = get_input(data, a, b, c)
+    local skip = tonumber(xtf8.xtf8_scan(src, len))
+    local size = skip + tonumber(f_bound(len - skip))
+    local p
+
+    if cap then
+        if cap < size then
+            -- Get the exact size (only if the bound doesn't fit).
+            local n = f_xtf8(nil, src + skip, len - skip, err)
+            if n == xtf8_aborted then
+                return nil, "found invalid sequence"
+            end
+            n = skip + tonumber(n)
+            if n > cap then
+                return nil, "buffer too small", n
+            end
+        end
+        p = ffi.cast(_ptr_type, dst)
+    else
+        p = dst:reserve(size)
+    end
+
+    ffi.copy(p, src, skip)
+    local e = f_xtf8(p + skip, src + skip, len - skip, err)
+    if e == xtf8_aborted then
+        return nil, "found invalid sequence"
+    end
+
+    local n = tonumber(e - ffi.cast("uintptr_t", p))
+    if not cap then
+        dst:commit(n)
+    end
+    return n
+end
+
+
+local function xtf8_encode_into(dst, ...)
+    return xtf8_into(xtf8.xtf8_encode, xtf8.xtf8_encode_bound, dst, ...)
+end
+
+
+local function xtf8_decode_into(dst, ...)
+    return xtf8_into(xtf8.xtf8_decode, xtf8.xtf8_decode_bound, dst, ...)
+end
+
+
+-- Span and offset arrays of the *_many() functions, grown as needed.
+local get_spans
+do
+    local _spans_type = ffi.typeof("struct xtf8_span[?]")
+    local _offsets_type = ffi.typeof("size_t[?]")
+    local _size = 0
+    local _spans, _offsets
+
+    function get_spans(n)
+        if n > _size then
+            _size = math.max(n, _size * 2, 64)
+            _spans = ffi.new(_spans_type, _size)
+            _offsets = ffi.new(_offsets_type, _size + 1)
+        end
+        return _spans, _offsets
+    end
+end
+
+
+local function xtf8_many(f_batch, f_bound, tbl, err)
+    err = err or xtf8.XTF8_ERR_REPLACE
+    local n = #tbl
+    local spans, offsets = get_spans(n)
+    local result, index = {}, {}
+    local k, total = 0, 0
+
+    -- The strings are referenced by 'tbl' during the call.
+    for i = 1, n do
+        local data = tbl[i]
+        if type(data) ~= "string" then
+            error("bad argument #1 (array of strings expected)", 3)
+        end
+        local len = #data
+        if tonumber(xtf8.xtf8_scan(data, len)) == len then
+            -- Nothing to change
+            result[i] = data
+        else
+            spans[k].ptr = data
+            spans[k].len = len
+            k = k + 1
+            index[k] = i
+            total = total + len
+        end
+    end
+
+    if k > 0 then
+        local buf = get_buffer(tonumber(f_bound(total)))
+        if f_batch(buf, spans, k, offsets, err) == xtf8_aborted then
+            return nil, "found invalid sequence"
+        end
+        for j = 1, k do
+            result[index[j]] = ffi.string(buf + offsets[j-1],
+                                          tonumber(offsets[j] - offsets[j-1]))
+        end
+    end
+
+    return result
+end
+
+
+local function xtf8_encode_many(tbl, err)
+    return xtf8_many(xtf8.xtf8_encode_batch, xtf8.xtf8_encode_bound, tbl, err)
+end
+
+
+local function xtf8_decode_many(tbl, err)
+    return xtf8_many(xtf8.xtf8_decode_batch, xtf8.xtf8_decode_bound, tbl, err)
+end
+
+
+local function xtf8_kernel()
+    return ffi.string(xtf8.xtf8_kernel())
 end
 
 
@@ -149,7 +456,15 @@ local _M = {
     ERR_ABORT   = xtf8.XTF8_ERR_ABORT,
 
     encode = xtf8_encode,
+    encode_json = xtf8_encode_json,
     decode = xtf8_decode,
+    decode_json = xtf8_decode_json,
+    encode_into = xtf8_encode_into,
+    decode_into = xtf8_decode_into,
+    encode_many = xtf8_encode_many,
+    decode_many = xtf8_decode_many,
+    kernel = xtf8_kernel,
+    set_buffer = set_buffer,
 }
 
 
@@ -0,0 +1,581 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Benchmark of the XTF8 codec over generated corpora.
+ *
+ * Each function is run over each corpus of each size in batches of
+ * doubling number of calls, until a batch takes at least the minimum
+ * time; and the time of the last batch is reported.  The decoding
+ * functions take the encoded corpus as input.
+ *
+ * The output is one line per measurement, either as whitespace separated
+ * columns (with a header line) or as JSON objects (-j), which can be
+ * tracked across releases.  The cycles/byte is measured with the time
+ * stamp counter on x86, and not available on other platforms.
+ *
+ * Set the environment variable XTF8_KERNEL to compare the vectorized
+ * kernels.
+ *
+ * With -V, the scalar DFA and the one-step sequence decoding in utf8.h
+ * are instead verified against the reference DFA.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> /* __rdtsc() */
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "xtf8.h"
+#include "utf8.h"
+
+
+typedef uintptr_t (*xtf8_func)(void *, const void *, size_t, int);
+
+static uint64_t rng_state;
+
+/* xorshift64* */
+static uint32_t
+rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/*
+ * Put the code point $cp in UTF-8 at $d if it fits in $room bytes,
+ * otherwise a printable ASCII character; return the length written.
+ */
+static size_t
+put_cp(uint8_t *d, size_t room, uint32_t cp)
+{
+    size_t n;
+
+    n = (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+    if (n > room) {
+        *d = 'a';
+        return 1;
+    }
+
+    switch (n) {
+    case 1:
+        d[0] = (uint8_t)cp;
+        break;
+    case 2:
+        d[0] = (uint8_t)(0xC0 | cp >> 6);
+        d[1] = (uint8_t)(0x80 | (cp & 0x3F));
+        break;
+    case 3:
+        d[0] = (uint8_t)(0xE0 | cp >> 12);
+        d[1] = (uint8_t)(0x80 | (cp >> 6 & 0x3F));
+        d[2] = (uint8_t)(0x80 | (cp & 0x3F));
+        break;
+    default:
+        d[0] = (uint8_t)(0xF0 | cp >> 18);
+        d[1] = (uint8_t)(0x80 | (cp >> 12 & 0x3F));
+        d[2] = (uint8_t)(0x80 | (cp >> 6 & 0x3F));
+        d[3] = (uint8_t)(0x80 | (cp & 0x3F));
+        break;
+    }
+    return n;
+}
+
+/* Log-like printable ASCII text */
+static uint8_t
+ascii_char(void)
+{
+    static const char chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "0123456789     ::==//..--_\"";
+    uint32_t r;
+
+    r = rng();
+    if (r % 80 == 0)
+        return '\n';
+    return (uint8_t)chars[(r >> 8) % (sizeof(chars) - 1)];
+}
+
+static void
+gen_ascii(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = ascii_char();
+}
+
+/* Mostly CJK (3 bytes) and emoji (4 bytes), with some ASCII */
+static void
+gen_cjk(uint8_t *buf, size_t len)
+{
+    size_t i;
+    uint32_t r, cp;
+
+    for (i = 0; i < len; ) {
+        r = rng();
+        if (r % 20 < 12)
+            cp = 0x4E00 + (r >> 8) % 0x5200;
+        else if (r % 20 < 17)
+            cp = 0x1F300 + (r >> 8) % 0x700;
+        else
+            cp = ascii_char();
+        i += put_cp(buf + i, len - i, cp);
+    }
+}
+
+/* Random bytes, i.e., 100% binary */
+static void
+gen_binary(uint8_t *buf, size_t len)
+{
+    size_t i;
+    uint32_t r;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        r = rng();
+        memcpy(buf + i, &r, 4);
+    }
+    for (; i < len; i++)
+        buf[i] = (uint8_t)rng();
+}
+
+/* ASCII logs with 1% of binary bytes */
+static void
+gen_log1(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (rng() % 100 == 0)
+            buf[i] = (uint8_t)(0x80 | rng());
+        else
+            buf[i] = ascii_char();
+    }
+}
+
+/* Half of the characters colliding with the XTF8 encoding area */
+static void
+gen_pua(uint8_t *buf, size_t len)
+{
+    size_t i;
+    uint32_t r, cp;
+
+    for (i = 0; i < len; ) {
+        r = rng();
+        if (r % 2 == 0)
+            cp = 0xEF80 + (r >> 8) % 0x80; /* U+EF80..U+EFFF */
+        else if (r % 8 == 1)
+            cp = 0x4E00 + (r >> 8) % 0x5200;
+        else
+            cp = ascii_char();
+        i += put_cp(buf + i, len - i, cp);
+    }
+}
+
+static const struct corpus {
+    const char *name;
+    void (*gen)(uint8_t *, size_t);
+} corpora[] = {
+    { "ascii", gen_ascii },
+    { "cjk", gen_cjk },
+    { "binary", gen_binary },
+    { "log1", gen_log1 },
+    { "pua", gen_pua },
+};
+
+/*
+ * Adapt xtf8_decode_size() to the codec signature; $dst is unused.
+ */
+static uintptr_t
+decode_size(void *dst, const void *src, size_t len, int error)
+{
+    (void)dst;
+    return xtf8_decode_size(src, len, error);
+}
+
+/*
+ * Adapt xtf8_validate() to the codec signature, returning the offset of
+ * the first error (the encoded input is always valid).
+ */
+static uintptr_t
+validate(void *dst, const void *src, size_t len, int error)
+{
+    size_t offset;
+
+    (void)dst;
+    (void)error;
+    xtf8_validate(src, len, &offset, NULL);
+    return (uintptr_t)offset;
+}
+
+static const struct func {
+    const char *name;
+    xtf8_func f;
+    xtf8_func prep; /* to prepare the input from corpus */
+} funcs[] = {
+    { "encode", xtf8_encode, NULL },
+    { "decode", xtf8_decode, xtf8_encode },
+    { "encode_json", xtf8_encode_json, NULL },
+    { "decode_json", xtf8_decode_json, xtf8_encode_json },
+    { "decode_size", decode_size, xtf8_encode },
+    { "validate", validate, xtf8_encode },
+};
+
+#define NELEM(a)    (sizeof(a) / sizeof((a)[0]))
+
+static const char *default_sizes = "64,4K,1M,1G";
+
+/* Result of the calls, to keep them from being optimized out */
+static volatile uintptr_t sink;
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+cycles(void)
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Parse the size with optional suffix K, M or G (powers of 1024).
+ */
+static size_t
+parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n;
+
+    n = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'K': case 'k': n <<= 10; end++; break;
+    case 'M': case 'm': n <<= 20; end++; break;
+    case 'G': case 'g': n <<= 30; end++; break;
+    }
+    if (end == s || *end != '\0' || n == 0 || n > SIZE_MAX / 8)
+        errx(EXIT_FAILURE, "invalid size: %s", s);
+
+    return (size_t)n;
+}
+
+/*
+ * Return whether $name is in the comma separated $list, or $list is NULL.
+ */
+static bool
+selected(const char *list, const char *name)
+{
+    const char *p;
+    size_t n;
+
+    if (list == NULL)
+        return true;
+
+    n = strlen(name);
+    for (p = list; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+        if (strncmp(p, name, n) == 0 && (p[n] == ',' || p[n] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Run $fn over the $corpus of $size bytes and print the result.
+ * Return false if out of memory.
+ */
+static bool
+bench(const struct corpus *corpus, const struct func *fn, size_t size,
+      double mintime, bool json)
+{
+    uint8_t *data, *input, *output;
+    size_t inlen, outlen;
+    uint64_t iters, i, c0, c1;
+    double t0, t1, ns, gbps, cpb;
+    uintptr_t end;
+
+    data = malloc(size);
+    if (data == NULL)
+        return false;
+    rng_state = 0x9E3779B97F4A7C15ULL;
+    corpus->gen(data, size);
+
+    if (fn->prep != NULL) {
+        inlen = (size_t)fn->prep(NULL, data, size, XTF8_ERR_REPLACE);
+        input = malloc(inlen);
+        if (input == NULL) {
+            free(data);
+            return false;
+        }
+        fn->prep(input, data, size, XTF8_ERR_REPLACE);
+        free(data);
+    } else {
+        input = data;
+        inlen = size;
+    }
+
+    /* Exact size instead of the bound, the 1 GiB runs are large. */
+    end = fn->f(NULL, input, inlen, XTF8_ERR_REPLACE);
+    if (end == XTF8_ABORTED)
+        errx(EXIT_FAILURE, "%s/%s: failed", corpus->name, fn->name);
+    outlen = (size_t)end;
+    output = malloc(outlen > 0 ? outlen : 1);
+    if (output == NULL) {
+        free(input);
+        return false;
+    }
+
+    /* Warm up, which also faults in the output pages. */
+    sink = fn->f(output, input, inlen, XTF8_ERR_REPLACE);
+
+    for (iters = 1; ; iters *= 2) {
+        t0 = now();
+        c0 = cycles();
+        for (i = 0; i < iters; i++)
+            sink = fn->f(output, input, inlen, XTF8_ERR_REPLACE);
+        c1 = cycles();
+        t1 = now();
+        if (t1 - t0 >= mintime)
+            break;
+    }
+
+    ns = (t1 - t0) * 1e9 / (double)iters;
+    gbps = (double)inlen / ns;
+    cpb = (double)(c1 - c0) / (double)iters / (double)inlen;
+
+    if (json) {
+        printf("{\"corpus\":\"%s\",\"func\":\"%s\",\"size\":%zu,"
+               "\"bytes\":%zu,\"kernel\":\"%s\",\"iters\":%llu,"
+               "\"ns_per_call\":%.1f,\"gb_per_s\":%.3f,",
+               corpus->name, fn->name, size, inlen, xtf8_kernel(),
+               (unsigned long long)iters, ns, gbps);
+        if (HAVE_TSC)
+            printf("\"cycles_per_byte\":%.3f}\n", cpb);
+        else
+            printf("\"cycles_per_byte\":null}\n");
+    } else {
+        printf("%-8s %-12s %10zu %10zu %-9s %14.1f %8.3f ",
+               corpus->name, fn->name, size, inlen, xtf8_kernel(),
+               ns, gbps);
+        if (HAVE_TSC)
+            printf("%9.3f\n", cpb);
+        else
+            printf("%9s\n", "-");
+    }
+    fflush(stdout);
+
+    free(input);
+    free(output);
+    return true;
+}
+
+
+/*
+ * Verify utf8_decode() and utf8_next() against utf8_decode_ref() with
+ * every byte appended to the sequence $buf of length $n, whose states
+ * so far are $ref (reference) and $state; and recurse into the longer
+ * sequences (up to 4 bytes) while the reference doesn't accept them.
+ *
+ * This covers every reachable transition, so the DFAs are equivalent
+ * if there are no mismatches.  The sequences rejected after a valid
+ * leading byte are also extended, with the continuation bytes and a few
+ * others, to check that utf8_next() rejects them as a whole.  Return the
+ * number of mismatches.
+ */
+static size_t
+utf8_verify(uint8_t *buf, size_t n, uint32_t ref, uint32_t ref_cp,
+            uint32_t state, uint32_t cp)
+{
+    uint32_t r, rc, st, c, nc;
+    size_t b, k, want, nbad;
+
+    nbad = 0;
+    for (b = 0; b < 256; b++) {
+        if (ref == UTF8_REF_REJECT && (b & 0xC0) != 0x80 &&
+            b != 0x00 && b != 0x7F && b != 0xC0 && b != 0xFF)
+            continue;
+        buf[n] = (uint8_t)b;
+        r = ref;
+        rc = ref_cp;
+        st = state;
+        c = cp;
+        utf8_decode_ref(&r, &rc, (uint32_t)b);
+        utf8_decode(&st, &c, (uint32_t)b);
+
+        /* The states are numbered by 12 and 6, respectively. */
+        want = (r == UTF8_REF_ACCEPT) ? n + 1 : 0;
+        nc = 0;
+        k = utf8_next(buf, n + 1, &nc);
+        if (st * 2 != r || (r == UTF8_REF_ACCEPT && c != rc) || k != want ||
+            (k > 0 && nc != rc)) {
+            if (nbad++ < 10) {
+                warnx("mismatch of %zu byte(s) ending with 0x%02zx: "
+                      "ref=%u/U+%04X dfa=%u/U+%04X next=%zu/U+%04X",
+                      n + 1, b, r, rc, st, c, k, nc);
+            }
+            continue;
+        }
+
+        if (r != UTF8_REF_ACCEPT && n + 1 < 4 &&
+            (r != UTF8_REF_REJECT || (buf[0] >= 0xC2 && buf[0] <= 0xF4)))
+            nbad += utf8_verify(buf, n + 1, r, rc, st, c);
+    }
+
+    return nbad;
+}
+
+
+static void
+usage(void)
+{
+    fputs("XTF8 codec benchmark\n"
+          "\n"
+          "usage: xtf8_bench [OPTIONS]\n"
+          "\n"
+          "options:\n"
+          "    -c <corpora> : comma separated corpora to run "
+          "(ascii,cjk,binary,log1,pua)\n"
+          "    -f <funcs> : comma separated functions to run "
+          "(encode,decode,encode_json,decode_json,\n"
+          "                 decode_size,validate)\n"
+          "    -s <sizes> : comma separated corpus sizes "
+          "(default: 64,4K,1M,1G)\n"
+          "    -t <seconds> : minimum time of each measurement "
+          "(default: 0.2)\n"
+          "    -j : output JSON objects, one per line\n"
+          "    -V : verify the scalar DFA against the reference and exit\n"
+          "\n",
+          stderr);
+
+    exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *clist, *flist, *sizes, *p, *q;
+    char tok[32];
+    uint8_t seq[4];
+    size_t c, f, n, size;
+    double mintime;
+    bool json;
+    int opt;
+
+    clist = flist = NULL;
+    sizes = NULL;
+    mintime = 0.2;
+    json = false;
+
+    while ((opt = getopt(argc, argv, "Vc:f:hjs:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            clist = optarg;
+            break;
+        case 'f':
+            flist = optarg;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 't':
+            mintime = atof(optarg);
+            break;
+        case 'V':
+            n = utf8_verify(seq, 0, UTF8_REF_ACCEPT, 0, UTF8_ACCEPT, 0);
+            if (n > 0)
+                errx(EXIT_FAILURE, "DFA verification: %zu mismatches", n);
+            printf("DFA verification: OK\n");
+            return 0;
+        case 'h':
+        default:
+            usage();
+        }
+    }
+    if (argc != optind)
+        usage();
+
+    if (sizes == NULL)
+        sizes = default_sizes;
+
+    if (!json) {
+        printf("%-8s %-12s %10s %10s %-9s %14s %8s %9s\n",
+               "corpus", "func", "size", "bytes", "kernel",
+               "ns/call", "GB/s", "cycles/B");
+    }
+
+    for (p = sizes; *p != '\0'; p = (*q == ',') ? q + 1 : q) {
+        q = strchr(p, ',');
+        if (q == NULL)
+            q = p + strlen(p);
+        n = (size_t)(q - p);
+        if (n >= sizeof(tok))
+            errx(EXIT_FAILURE, "invalid size: %.*s", (int)n, p);
+        memcpy(tok, p, n);
+        tok[n] = '\0';
+        size = parse_size(tok);
+
+        for (c = 0; c < NELEM(corpora); c++) {
+            if (!selected(clist, corpora[c].name))
+                continue;
+            for (f = 0; f < NELEM(funcs); f++) {
+                if (!selected(flist, funcs[f].name))
+                    continue;
+                if (!bench(&corpora[c], &funcs[f], size, mintime, json)) {
+                    warnx("%s/%s/%zu: out of memory, skipped",
+                          corpora[c].name, funcs[f].name, size);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
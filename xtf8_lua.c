@@ -26,13 +26,36 @@
 /*
  * API
  * ---
- * encoded = xtf8.encode(data, err?)
- * decoded = xtf8.decode(data, err?)
+ * encoded = xtf8.encode(data, err?, offset?, length?)
+ * decoded = xtf8.decode(data, err?, offset?, length?)
+ * escaped = xtf8.encode_json(data, err?, offset?, length?)
+ * decoded = xtf8.decode_json(escaped, err?, offset?, length?)
+ * encoded_tbl = xtf8.encode_many(tbl, err?)
+ * decoded_tbl = xtf8.decode_many(tbl, err?)
+ * kernel = xtf8.kernel()
  *
  * The 'err' parameter is optional, and can have the following values:
  * - xtf8.ERR_REPLACE : replace conflicting characters (default)
  * - xtf8.ERR_ABORT : terminate the encoding process
  *
+ * The encode_json() function encodes the data and escapes the result to
+ * be a valid JSON string (without the surrounding quotes) in one pass;
+ * and the decode_json() function does the reverse.
+ *
+ * The optional 'offset' (1-based, default 1) and 'length' (default: to
+ * the end) parameters select the slice of the data to process, as
+ * data:sub(offset, offset + length - 1) but without creating that
+ * string.
+ *
+ * The encode() and decode() functions return the original string (or
+ * the slice) if nothing needs to be changed.
+ *
+ * The encode_many() and decode_many() functions process all the strings
+ * in the array 'tbl' in one call, and return a new array of the results.
+ *
+ * The kernel() function returns the name of the vectorized kernel in use
+ * (e.g., "avx2").
+ *
  * Usage
  * -----
  * local xtf8 = require("xtf8")
@@ -41,8 +64,9 @@
  * assert(decoded == data)
  */
 
-#include <stdbool.h>
-#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -55,42 +79,117 @@
         (lua_newtable(L), luaL_register(L, NULL, l))
 #endif
 
+#if LUA_VERSION_NUM >= 502
+#define lua_objlen(L, i)    lua_rawlen(L, (i))
+#endif
+
+
+/*
+ * Get the slice of the string $in of length $len selected by the
+ * optional offset (1-based) and length arguments at indexes $i and
+ * ($i + 1), with its length saved in $slen.
+ */
+static const char *
+l_slice(lua_State *L, int i, const char *in, size_t len, size_t *slen)
+{
+    lua_Integer off, n;
+
+    off = luaL_optinteger(L, i, 1);
+    luaL_argcheck(L, off >= 1 && (uintmax_t)(off - 1) <= len, i,
+                  "offset out of range");
+    len -= (size_t)(off - 1);
+
+    n = luaL_optinteger(L, i + 1, (lua_Integer)len);
+    luaL_argcheck(L, n >= 0 && (uintmax_t)n <= len, i + 1,
+                  "length out of range");
+
+    *slen = (size_t)n;
+    return in + (off - 1);
+}
+
 
+/*
+ * Process the string (or its slice) at index 1 with $f_xtf8, into a
+ * buffer of the exact size given by $f_size if not NULL, or of the size
+ * bounded by $f_bound.
+ */
 static int
-l_helper(lua_State *L, bool is_encode)
+l_helper(lua_State *L, uintptr_t (*f_xtf8)(void *, const void *, size_t, int),
+         size_t (*f_bound)(size_t),
+         uintptr_t (*f_size)(const void *, size_t, int), int scan)
 {
     luaL_Buffer b;
-    const char *in;
+    const char *in, *str;
     char *p;
-    size_t inlen, outlen;
+    size_t len, inlen, outlen, bound, size, skip;
     int err;
-    uintptr_t (*f_xtf8)(void *, const void *, size_t, int);
+    uintptr_t end;
 
-    f_xtf8 = is_encode ? xtf8_encode : xtf8_decode;
-    in = luaL_checklstring(L, 1, &inlen);
+    str = luaL_checklstring(L, 1, &len);
     err = luaL_optinteger(L, 2, XTF8_ERR_REPLACE);
-    luaL_buffinit(L, &b);
+    in = l_slice(L, 3, str, len, &inlen);
 
-    outlen = (size_t)f_xtf8(NULL, in, inlen, err);
-    if ((uintptr_t)outlen == XTF8_ABORTED)
-        return luaL_error(L, "found invalid sequence");
-
-    if (outlen <= LUAL_BUFFERSIZE) {
-        p = luaL_prepbuffer(&b);
-        (void)f_xtf8(p, in, inlen, err);
-        luaL_addsize(&b, outlen);
+    skip = 0;
+    if (scan) {
+        skip = xtf8_scan(in, inlen);
+        if (skip == inlen) {
+            /* Nothing to change; return the original string. */
+            if (inlen == len) {
+                lua_settop(L, 1);
+            } else {
+                lua_pushlstring(L, in, inlen);
+            }
+            return 1;
+        }
+    }
 
+    if (f_size != NULL) {
+        end = f_size(in + skip, inlen - skip, err);
+        if (end == XTF8_ABORTED)
+            return luaL_error(L, "found invalid sequence");
+        bound = (size_t)end;
     } else {
-        p = malloc(outlen);
-        if (p == NULL)
-            return luaL_error(L, "out of memory");
+        bound = f_bound(inlen - skip);
+    }
+    if (bound > SIZE_MAX - skip)
+        return luaL_error(L, "out of memory");
+    size = skip + bound;
 
-        (void)f_xtf8(p, in, inlen, err);
-        luaL_addlstring(&b, p, outlen);
-        free(p);
+    /*
+     * Encode/decode directly into the memory owned by Lua: the buffer
+     * box with Lua >=5.2, or a userdata with Lua 5.1 and LuaJIT for
+     * large strings.  That saves the malloc() and one copy, but the
+     * result is still copied once into the string.
+     */
+#if LUA_VERSION_NUM >= 502
+    p = luaL_buffinitsize(L, &b, size);
+#else
+    if (size <= LUAL_BUFFERSIZE) {
+        luaL_buffinit(L, &b);
+        p = luaL_prepbuffer(&b);
+    } else {
+        p = lua_newuserdata(L, size);
     }
+#endif
+
+    /* Leading part that needs no change */
+    memcpy(p, in, skip);
 
-    luaL_pushresult(&b);
+    end = f_xtf8(p + skip, in + skip, inlen - skip, err);
+    if (end == XTF8_ABORTED)
+        return luaL_error(L, "found invalid sequence");
+    outlen = (size_t)(end - (uintptr_t)p);
+
+#if LUA_VERSION_NUM >= 502
+    luaL_pushresultsize(&b, outlen);
+#else
+    if (size <= LUAL_BUFFERSIZE) {
+        luaL_addsize(&b, outlen);
+        luaL_pushresult(&b);
+    } else {
+        lua_pushlstring(L, p, outlen);
+    }
+#endif
 
     return 1;
 }
@@ -99,14 +198,127 @@ l_helper(lua_State *L, bool is_encode)
 static int
 l_encode(lua_State *L)
 {
-    return l_helper(L, true);
+    return l_helper(L, xtf8_encode, xtf8_encode_bound, NULL, 1);
+}
+
+
+static int
+l_encode_json(lua_State *L)
+{
+    return l_helper(L, xtf8_encode_json, xtf8_encode_json_bound, NULL, 0);
 }
 
 
 static int
 l_decode(lua_State *L)
 {
-    return l_helper(L, false);
+    return l_helper(L, xtf8_decode, NULL, xtf8_decode_size, 1);
+}
+
+
+static int
+l_decode_json(lua_State *L)
+{
+    return l_helper(L, xtf8_decode_json, xtf8_decode_bound, NULL, 0);
+}
+
+
+/*
+ * Process the strings in the array at index 1 with the batch function
+ * $f_batch, and return a new array of the results.  The strings needing
+ * no change are used as they are.
+ */
+static int
+l_many_helper(lua_State *L,
+              uintptr_t (*f_batch)(void *, const struct xtf8_span *, size_t,
+                                   size_t *, int),
+              size_t (*f_bound)(size_t))
+{
+    struct xtf8_span *spans;
+    const char *in;
+    char *p;
+    size_t *offsets;
+    size_t n, i, k, inlen, total, bound;
+    int *index;
+    int err;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    err = (int)luaL_optinteger(L, 2, XTF8_ERR_REPLACE);
+    lua_settop(L, 2);
+
+    n = lua_objlen(L, 1);
+    if (n > INT_MAX)
+        return luaL_error(L, "too many strings");
+    lua_createtable(L, (int)n, 0); /* results at index 3 */
+
+    p = lua_newuserdata(L, n * (sizeof(*spans) + sizeof(*offsets) +
+                                sizeof(*index)) + sizeof(*offsets));
+    spans = (struct xtf8_span *)(void *)p;
+    offsets = (size_t *)(void *)(spans + n);
+    index = (int *)(void *)(offsets + n + 1);
+
+    /* The strings are referenced by the array during the call. */
+    for (total = 0, k = 0, i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, (int)i);
+        if (lua_type(L, -1) != LUA_TSTRING)
+            return luaL_argerror(L, 1, "array of strings expected");
+        in = lua_tolstring(L, -1, &inlen);
+
+        if (xtf8_scan(in, inlen) == inlen) {
+            /* Nothing to change */
+            lua_rawseti(L, 3, (int)i);
+            continue;
+        }
+        lua_pop(L, 1);
+
+        if (inlen > SIZE_MAX - total)
+            return luaL_error(L, "out of memory");
+        total += inlen;
+        spans[k].ptr = in;
+        spans[k].len = inlen;
+        index[k] = (int)i;
+        k++;
+    }
+
+    if (k > 0) {
+        bound = f_bound(total);
+        if (bound == SIZE_MAX)
+            return luaL_error(L, "out of memory");
+        p = lua_newuserdata(L, bound);
+
+        if (f_batch(p, spans, k, offsets, err) == XTF8_ABORTED)
+            return luaL_error(L, "found invalid sequence");
+
+        for (i = 0; i < k; i++) {
+            lua_pushlstring(L, p + offsets[i], offsets[i+1] - offsets[i]);
+            lua_rawseti(L, 3, index[i]);
+        }
+    }
+
+    lua_pushvalue(L, 3);
+    return 1;
+}
+
+
+static int
+l_encode_many(lua_State *L)
+{
+    return l_many_helper(L, xtf8_encode_batch, xtf8_encode_bound);
+}
+
+
+static int
+l_decode_many(lua_State *L)
+{
+    return l_many_helper(L, xtf8_decode_batch, xtf8_decode_bound);
+}
+
+
+static int
+l_kernel(lua_State *L)
+{
+    lua_pushstring(L, xtf8_kernel());
+    return 1;
 }
 
 
@@ -115,7 +327,12 @@ luaopen_xtf8(lua_State *L)
 {
     static const struct luaL_Reg funcs[] = {
         { "encode", l_encode },
+        { "encode_json", l_encode_json },
         { "decode", l_decode },
+        { "decode_json", l_decode_json },
+        { "encode_many", l_encode_many },
+        { "decode_many", l_decode_many },
+        { "kernel", l_kernel },
         { NULL, NULL },
     };
     luaL_newlib(L, funcs);
@@ -23,14 +23,27 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* madvise(), mremap() */
+#endif
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include <assert.h>
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xtf8.h"
@@ -44,349 +57,1333 @@
 #endif
 
 
+/*
+ * Return the monotonic time in seconds.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Phases of the processing timed by the profiling (-P).  The JSON
+ * escaping and unescaping are done in the same pass as the codec, and
+ * the outputs are sized by the *_bound() functions without a pass, so
+ * they have no phases of their own.
+ */
+enum phase {
+    PHASE_READ,     /* reading or mapping the input */
+    PHASE_CODEC,    /* encoding/decoding, with the JSON escaping */
+    PHASE_INDEX,    /* building the checkpoint index */
+    PHASE_HEXDUMP,  /* formatting and writing the hexdump */
+    PHASE_WRITE,    /* writing the output */
+    PHASE_MAX,
+};
+
+static const char *const phase_names[PHASE_MAX] = {
+    "read", "codec", "index", "hexdump", "write",
+};
+
+struct profile {
+    double secs[PHASE_MAX];
+    size_t bytes[PHASE_MAX];
+    size_t nallocs;
+};
+
+/* The profile being collected, or NULL if not profiling */
+static struct profile *prof;
+
+/*
+ * Return the start time of a phase, to be passed to prof_end().
+ */
+static double
+prof_begin(void)
+{
+    return (prof != NULL) ? now() : 0.0;
+}
+
+/*
+ * Account the time since $t0 and the $bytes processed to the phase $ph.
+ */
+static void
+prof_end(enum phase ph, double t0, size_t bytes)
+{
+    if (prof == NULL)
+        return;
+    prof->secs[ph] += now() - t0;
+    prof->bytes[ph] += bytes;
+}
+
+/*
+ * The allocators of the CLI, which count the allocations when profiling.
+ */
+static void *
+prof_malloc(size_t size)
+{
+    if (prof != NULL)
+        prof->nallocs++;
+    return malloc(size);
+}
+
+static void *
+prof_calloc(size_t n, size_t size)
+{
+    if (prof != NULL)
+        prof->nallocs++;
+    return calloc(n, size);
+}
+
+static void *
+prof_realloc(void *ptr, size_t size)
+{
+    if (prof != NULL)
+        prof->nallocs++;
+    return realloc(ptr, size);
+}
+
+/*
+ * Print the profile of the run that took $secs seconds in total, as
+ * a table or as a JSON object if $json.
+ */
+static void
+print_profile(FILE *fp, const struct profile *pf, double secs, bool json)
+{
+    struct rusage ru;
+    long maxrss;
+    double mbps;
+    int i;
+
+    /* ru_maxrss is in kilobytes, except in bytes on macOS. */
+    maxrss = (getrusage(RUSAGE_SELF, &ru) == 0) ? ru.ru_maxrss : -1;
+#ifdef __APPLE__
+    if (maxrss > 0)
+        maxrss /= 1024;
+#endif
+
+    if (json)
+        fprintf(fp, "{\"phases\": {");
+    else
+        fprintf(fp, "%-8s %10s %14s %10s\n",
+                "Phase", "Time (s)", "Bytes", "MB/s");
+
+    for (i = 0; i < PHASE_MAX; i++) {
+        mbps = ((pf->secs[i] > 0) ?
+                (double)pf->bytes[i] / pf->secs[i] / 1e6 : 0.0);
+        if (json) {
+            fprintf(fp, "%s\"%s\": {\"secs\": %.6f, \"bytes\": %zu, "
+                    "\"mbps\": %.1f}", (i > 0) ? ", " : "",
+                    phase_names[i], pf->secs[i], pf->bytes[i], mbps);
+        } else {
+            fprintf(fp, "%-8s %10.6f %14zu %10.1f\n",
+                    phase_names[i], pf->secs[i], pf->bytes[i], mbps);
+        }
+    }
+
+    if (json) {
+        fprintf(fp, "}, \"total_secs\": %.6f, \"peak_rss_kib\": %ld, "
+                "\"allocations\": %zu}\n", secs, maxrss, pf->nallocs);
+    } else {
+        fprintf(fp, "Total: %.6f s\n", secs);
+        fprintf(fp, "Peak RSS: %ld KiB\n", maxrss);
+        fprintf(fp, "Allocations: %zu\n", pf->nallocs);
+    }
+}
+
+
+/* Size of the output buffer of the hexdump */
+#define HEXDUMP_BUFSIZE (64 * 1024)
+/* Maximum length of a line, with an offset of up to 16 digits */
+#define HEXDUMP_LINE_MAX    (16 + 2 + 49 + 2 + 16 + 2)
+
+/*
+ * State of the streaming hexdump, in the same format as 'hexdump -C',
+ * including the squeezing of the repeated lines to a '*' line.
+ */
+struct hexdump {
+    FILE *fp;
+    size_t off; /* offset of the pending line */
+    uint8_t line[16]; /* pending partial line */
+    size_t n;
+    uint8_t prev[16]; /* the last full line shown */
+    bool has_prev, squeezing;
+    size_t len;
+    char buf[HEXDUMP_BUFSIZE];
+};
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+static void
+hexdump_init(struct hexdump *h, FILE *fp)
+{
+    h->fp = fp;
+    h->off = h->n = h->len = 0;
+    h->has_prev = h->squeezing = false;
+}
+
+static void
+hexdump_drain(struct hexdump *h)
+{
+    if (h->len > 0 && fwrite(h->buf, 1, h->len, h->fp) != h->len)
+        err(1, "fwrite() failed");
+    h->len = 0;
+}
+
+/*
+ * Render the offset $off as at least 8 hexadecimal digits to $p, and
+ * return the end.
+ */
+static char *
+hexdump_offset(char *p, size_t off)
+{
+    unsigned int i, ndigits;
+
+    for (ndigits = 8; ndigits < sizeof(off) * 2; ndigits++) {
+        if ((off >> (ndigits * 4)) == 0)
+            break;
+    }
+    for (i = ndigits; i > 0; i--)
+        *p++ = hex_digits[(off >> ((i - 1) * 4)) & 0xF];
+
+    return p;
+}
+
+/*
+ * Render the line $b of $n (at most 16) bytes, or squeeze it if it's a
+ * full line identical to the previous one.
+ */
+static void
+hexdump_line(struct hexdump *h, const uint8_t *b, size_t n)
+{
+    char *p;
+    size_t i;
+
+    if (n == 16) {
+        if (h->has_prev && memcmp(b, h->prev, 16) == 0) {
+            if (!h->squeezing) {
+                if (HEXDUMP_BUFSIZE - h->len < 2)
+                    hexdump_drain(h);
+                h->buf[h->len++] = '*';
+                h->buf[h->len++] = '\n';
+                h->squeezing = true;
+            }
+            h->off += 16;
+            return;
+        }
+        memcpy(h->prev, b, 16);
+        h->has_prev = true;
+    }
+    h->squeezing = false;
+
+    if (HEXDUMP_BUFSIZE - h->len < HEXDUMP_LINE_MAX)
+        hexdump_drain(h);
+    p = hexdump_offset(h->buf + h->len, h->off);
+    *p++ = ' ';
+    *p++ = ' ';
+    for (i = 0; i < 16; i++) {
+        if (i < n) {
+            p[0] = hex_digits[b[i] >> 4];
+            p[1] = hex_digits[b[i] & 0xF];
+        } else {
+            p[0] = p[1] = ' ';
+        }
+        p[2] = ' ';
+        p += 3;
+        if (i == 7)
+            *p++ = ' ';
+    }
+    *p++ = ' ';
+    *p++ = '|';
+    for (i = 0; i < n; i++)
+        *p++ = (b[i] >= 0x20 && b[i] < 0x7F) ? (char)b[i] : '.';
+    *p++ = '|';
+    *p++ = '\n';
+
+    h->len = (size_t)(p - h->buf);
+    h->off += n;
+}
+
+/*
+ * Dump the next chunk $data of length $len.
+ */
+static void
+hexdump_write(struct hexdump *h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t k;
+
+    if (h->n > 0) {
+        k = 16 - h->n;
+        if (k > len)
+            k = len;
+        memcpy(h->line + h->n, p, k);
+        h->n += k;
+        p += k;
+        len -= k;
+        if (h->n < 16)
+            return;
+        hexdump_line(h, h->line, 16);
+        h->n = 0;
+    }
+
+    for (; len >= 16; p += 16, len -= 16)
+        hexdump_line(h, p, 16);
+
+    memcpy(h->line, p, len);
+    h->n = len;
+}
+
+/*
+ * Finish the dump with the last partial line and the total length.
+ */
+static void
+hexdump_end(struct hexdump *h)
+{
+    char *p;
+
+    if (h->n > 0) {
+        hexdump_line(h, h->line, h->n);
+        h->n = 0;
+    }
+    if (h->off > 0) {
+        if (HEXDUMP_BUFSIZE - h->len < HEXDUMP_LINE_MAX)
+            hexdump_drain(h);
+        p = hexdump_offset(h->buf + h->len, h->off);
+        *p++ = '\n';
+        h->len = (size_t)(p - h->buf);
+    }
+
+    hexdump_drain(h);
+    fflush(h->fp);
+}
+
+/*
+ * Dump the $iovcnt buffers of $iov as one data, like hexdump().
+ */
+static void
+hexdump_iov(FILE *fp, const struct iovec *iov, int iovcnt)
+{
+    static struct hexdump h;
+    int i;
+
+    hexdump_init(&h, fp);
+    for (i = 0; i < iovcnt; i++)
+        hexdump_write(&h, iov[i].iov_base, iov[i].iov_len);
+    hexdump_end(&h);
+}
+
 /*
  * Dump the given $data of length $len in the same format as
  * 'hexdump -C'.
  */
 static void
-hexdump(FILE *fp, void *data, size_t len)
-{
-    static char hex[16 * 3 + 2]; /* extra space between octets */
-    static char text[16 + 1];
-    char *h, *t;
-    uint8_t *p;
-    size_t i, off;
-
-    p = data;
-    /* Suppress compilation warnings: -Wmaybe-uninitialized */
-    h = hex;
-    t = text;
-
-    for (off = 0, i = 0; i < len; i++) {
-        if (i % 16 == 0) {
-            memset(hex, 0, sizeof(hex));
-            memset(text, 0, sizeof(text));
-            h = hex;
-            t = text;
-        }
+hexdump(FILE *fp, const void *data, size_t len)
+{
+    static struct hexdump h;
+
+    hexdump_init(&h, fp);
+    hexdump_write(&h, data, len);
+    hexdump_end(&h);
+}
 
-        h += sprintf(h, "%02x %s", p[i], (i % 16 == 7) ? " " : "");
-        t += sprintf(t, "%c", isprint(p[i]) ? p[i] : '.');
 
-        if (i % 16 == 15 || i + 1 == len) {
-            fprintf(fp, "%08zx  %-49.49s |%s|\n", off, hex, text);
-            off = i + 1;
+/* Arenas of at least this size are mapped (on Linux) */
+#define ARENA_MAP_MIN   (1024 * 1024)
+/* Initial size of the arena when the input size is unknown */
+#define ARENA_MIN       (64 * 1024)
+/* Offset of the output after the input $n bytes, aligned to cache line */
+#define ARENA_ALIGN(n)  (((n) + 63) & ~(size_t)63)
+
+/*
+ * A growable buffer for the data that can be neither mapped nor
+ * streamed, i.e., the input read from a pipe or any unmappable file,
+ * and the output following it.  The memory is never zero-filled, since
+ * it's always overwritten.  On Linux, the large arenas are mapped
+ * anonymously and grown by mremap(), so that the pages are moved by
+ * the kernel instead of being copied; otherwise realloc() is used.
+ */
+struct arena {
+    uint8_t *base;
+    size_t size;
+    bool mapped;
+};
+
+/*
+ * Grow the arena $a to at least $size bytes, keeping its content.
+ * Return 0 on success, or -1 on failure with $a left intact.
+ */
+static int
+arena_reserve(struct arena *a, size_t size)
+{
+    void *p;
+
+    if (size <= a->size && a->base != NULL)
+        return 0;
+    if (size < ARENA_MIN)
+        size = ARENA_MIN;
+
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+    if (size >= ARENA_MAP_MIN) {
+        if (a->mapped) {
+            p = mremap(a->base, a->size, size, MREMAP_MAYMOVE);
+        } else {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED && a->size > 0) {
+                memcpy(p, a->base, a->size);
+                free(a->base);
+            }
+        }
+        if (p == MAP_FAILED) {
+            DPRINTF("failed to map arena of size %zu: %s",
+                    size, strerror(errno));
+            return -1;
         }
+        if (prof != NULL)
+            prof->nallocs++;
+        a->mapped = true;
+        goto out;
     }
+#endif
 
-    fprintf(fp, "%08zx\n", len);
-    fflush(fp);
+    p = prof_realloc(a->base, size);
+    if (p == NULL) {
+        DPRINTF("failed to allocate arena of size %zu", size);
+        return -1;
+    }
+
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+out:
+#endif
+    a->base = p;
+    a->size = size;
+    DPRINTF("reserved arena of size %zu (%s)",
+            size, a->mapped ? "mapped" : "heap");
+    return 0;
+}
+
+static void
+arena_free(struct arena *a)
+{
+    if (a->mapped)
+        munmap(a->base, a->size);
+    else
+        free(a->base);
+    memset(a, 0, sizeof(*a));
 }
 
 
 /*
- * Escape the given UTF-8 string to be a valid JSON string.
- * (RFC 8259, Section 7)
+ * Read from the given file $fp until EOF into the arena $a, with the
+ * data length saved in $size.  A regular file is read into an arena
+ * sized up front by its size, so it doesn't grow; otherwise the arena
+ * is grown by doubling.
  *
- * Credit: Nginx: src/core/ngx_string.c: ngx_escape_json()
+ * Return 0 on success, or -1 on failure.
  */
-static uintptr_t
-json_escape(void *dst, void *src, size_t len)
+static int
+read_file(FILE *fp, struct arena *a, size_t *size)
 {
-    uint8_t ch;
-    uint8_t *d, *s, *end;
-    size_t sz;
+    struct stat st;
+    size_t n, sz, want;
+
+    /* One more byte to see the EOF without growing. */
+    want = ARENA_MIN;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (uintmax_t)st.st_size < SIZE_MAX)
+        want = (size_t)st.st_size + 1;
 
-    d = dst;
-    s = src;
-    end = (uint8_t *)src + len;
     sz = 0;
+    for (;;) {
+        if (sz == a->size) {
+            if (arena_reserve(a, (sz == 0) ? want : sz * 2) != 0) {
+                fprintf(stderr, "%s: failed to allocate %zu bytes\n",
+                        __func__, (sz == 0) ? want : sz * 2);
+                return -1;
+            }
+        }
 
-    if (d == NULL) {
-        /* determine the escaped string length */
-
-        while (s < end) {
-            ch = *s++;
-
-            if (ch <= 0x1F) {
-                /* escape control characters */
-                sz++;
-                switch (ch) {
-                case '\n':
-                case '\r':
-                case '\t':
-                case '\b':
-                case '\f':
-                    sz++;
-                    break;
-                default:
-                    sz += sizeof("\\u00XX") - 2;
-                }
+        n = fread(a->base + sz, 1, a->size - sz, fp);
+        sz += n;
+        DPRINTF("read %zu bytes", n);
 
-            } else {
-                if (ch == '\\' || ch == '"') {
-                    /* escape reverse solidus (\) and quotation mark (") */
-                    sz++;
-                }
-                sz++;
+        if (n == 0 || sz < a->size) {
+            if (ferror(fp)) {
+                fprintf(stderr, "%s: fread() failed: %s\n",
+                        __func__, strerror(errno));
+                return -1;
             }
+            if (feof(fp))
+                break;
         }
+    }
+
+    *size = sz;
+    return 0;
+}
+
 
-        return (uintptr_t)sz;
+/*
+ * Map the given file $fp into memory if it's a non-empty regular file,
+ * with its size saved in $size.  Return NULL if the file is not
+ * eligible or failed to map, so the caller can fall back to reading.
+ *
+ * The returned data must be munmap()'d after use.
+ */
+static void *
+map_file(FILE *fp, size_t *size)
+{
+    struct stat st;
+    void *data;
+
+    if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX)
+        return NULL;
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                fileno(fp), 0);
+    if (data == MAP_FAILED) {
+        DPRINTF("mmap() failed: %s", strerror(errno));
+        return NULL;
     }
 
-    while (s < end) {
-        ch = *s++;
+    /* Only hints; ignore the errors. */
+    (void)posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    (void)madvise(data, (size_t)st.st_size, MADV_HUGEPAGE);
+#endif
 
-        if (ch <= 0x1F) {
-            *d++ = '\\';
+    DPRINTF("mapped file of size %zu", (size_t)st.st_size);
+    *size = (size_t)st.st_size;
+    return data;
+}
 
-            switch (ch) {
-            case '\n':
-                *d++ = 'n';
-                break;
-            case '\r':
-                *d++ = 'r';
-                break;
-            case '\t':
-                *d++ = 't';
-                break;
-            case '\b':
-                *d++ = 'b';
-                break;
-            case '\f':
-                *d++ = 'f';
-                break;
 
-            default: /* u00XX */
-                *d++ = 'u';
-                *d++ = '0';
-                *d++ = '0';
-                *d++ = '0' + (ch >> 4);
-                ch &= 0xF;
-                *d++ = (ch < 10) ? ('0' + ch) : ('A' + ch - 10);
-            }
+/*
+ * Write the $iovcnt buffers of $iov in order to file $fp, directly with
+ * writev() after flushing the stream.  The $iov is modified to track
+ * the partial writes.
+ */
+static int
+write_file(FILE *fp, struct iovec *iov, int iovcnt)
+{
+    ssize_t nw;
+    size_t n;
 
-        } else {
-            if (ch == '\\' || ch == '"')
-                *d++ = '\\';
-            *d++ = ch;
+    if (fflush(fp) != 0) {
+        fprintf(stderr, "%s: fflush() failed: %s\n",
+                __func__, strerror(errno));
+        return -1;
+    }
+
+    while (iovcnt > 0) {
+        nw = writev(fileno(fp), iov, iovcnt);
+        if (nw == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: writev() failed: %s\n",
+                    __func__, strerror(errno));
+            return -1;
+        }
+
+        /* Skip the buffers written, and advance into the partial one. */
+        for (n = (size_t)nw; iovcnt > 0 && n >= iov->iov_len; iovcnt--) {
+            n -= iov->iov_len;
+            iov++;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
     }
 
-    return (uintptr_t)d;
+    return 0;
 }
 
 
-#define JSON_ERR_UNESCAPE   ((uintptr_t)-1)
+/* Size of the read buffer in streaming mode */
+#define STREAM_BUFSIZE  (32 * 1024)
+
+typedef int (*stream_func)(xtf8_stream_t *, void *, size_t, const void *,
+                           size_t, size_t *, size_t *);
+typedef int (*flush_func)(xtf8_stream_t *, void *, size_t, size_t *);
 
 /*
- * Unescape the given JSON string to its original UTF-8 string.
+ * Select the streaming functions for the mode and return the output
+ * buffer size needed for every chunk of $chunk bytes.
+ */
+static size_t
+stream_funcs(bool decode, bool escape, size_t chunk,
+             stream_func *f_stream, flush_func *f_flush)
+{
+    if (decode) {
+        *f_stream = escape ? xtf8_stream_decode_json : xtf8_stream_decode;
+        *f_flush = (escape ? xtf8_stream_decode_json_flush :
+                    xtf8_stream_decode_flush);
+        return xtf8_decode_bound(chunk + 12);
+    } else {
+        *f_stream = escape ? xtf8_stream_encode_json : xtf8_stream_encode;
+        *f_flush = xtf8_stream_encode_flush;
+        return (escape ? xtf8_encode_json_bound(chunk + 12) :
+                xtf8_encode_bound(chunk + 12));
+    }
+}
+
+
+/*
+ * Encode/decode the data from file $infp to file $outfp chunk by chunk
+ * in constant memory, optionally with JSON escaping the output (encode
+ * mode) or unescaping the input (decode mode).
+ *
+ * If $map is not NULL, the input is instead taken directly from the
+ * mapped file $map of size $mapsize, without copying.  The statistics
+ * are collected into $stats if not NULL.  If $hd is not NULL, the output
+ * is dumped by it instead of written to $outfp.
+ *
+ * Return the number of input bytes processed.
+ */
+static size_t
+stream_file(FILE *infp, const uint8_t *map, size_t mapsize,
+            FILE *outfp, bool decode, bool escape, int xtf8_err,
+            struct xtf8_stats *stats, struct hexdump *hd)
+{
+    xtf8_stream_t ctx;
+    struct iovec iov;
+    const uint8_t *src;
+    uint8_t *ibuf, *obuf;
+    size_t n, total, osize, c, p;
+    bool eof;
+    int rc;
+    double t;
+    stream_func f_stream;
+    flush_func f_flush;
+
+    osize = stream_funcs(decode, escape, STREAM_BUFSIZE, &f_stream, &f_flush);
+
+    ibuf = (map == NULL) ? prof_malloc(STREAM_BUFSIZE) : NULL;
+    obuf = prof_malloc(osize);
+    if ((map == NULL && ibuf == NULL) || obuf == NULL)
+        err(1, "failed to allocate stream buffers");
+
+    xtf8_stream_init(&ctx, xtf8_err);
+    xtf8_stream_stats(&ctx, stats);
+    total = 0;
+    eof = false;
+
+    while (!eof) {
+        if (map != NULL) {
+            n = mapsize - total;
+            if (n > STREAM_BUFSIZE)
+                n = STREAM_BUFSIZE;
+            src = map + total;
+            eof = (total + n == mapsize);
+        } else {
+            t = prof_begin();
+            n = fread(ibuf, 1, STREAM_BUFSIZE, infp);
+            if (n != STREAM_BUFSIZE) {
+                if (ferror(infp))
+                    err(1, "fread() failed");
+                eof = true;
+            }
+            prof_end(PHASE_READ, t, n);
+            DPRINTF("read %zu bytes", n);
+            src = ibuf;
+        }
+        total += n;
+
+        t = prof_begin();
+        rc = f_stream(&ctx, obuf, osize, src, n, &c, &p);
+        if (rc != 0)
+            errx(1, "found invalid %s", (escape && decode) ?
+                 "JSON string" : "sequence");
+        assert(c == n);
+
+        if (eof) {
+            size_t fp;
+
+            rc = f_flush(&ctx, obuf + p, osize - p, &fp);
+            if (rc != 0)
+                errx(1, "found invalid %s", (escape && decode) ?
+                     "JSON string" : "sequence");
+            p += fp;
+        }
+        prof_end(PHASE_CODEC, t, n);
+
+        t = prof_begin();
+        iov.iov_base = obuf;
+        iov.iov_len = p;
+        if (hd != NULL)
+            hexdump_write(hd, obuf, p);
+        else if (write_file(outfp, &iov, 1) != 0)
+            exit(EXIT_FAILURE);
+        prof_end((hd != NULL) ? PHASE_HEXDUMP : PHASE_WRITE, t, p);
+    }
+
+    free(ibuf);
+    free(obuf);
+
+    return total;
+}
+
+
+/*
+ * Encode/decode the whole $src of length $len into $dst of capacity
+ * $dstcap as one chunk of a stream, so that the statistics can be
+ * collected into $stats for all the modes.  Return the end of the
+ * output, or XTF8_ABORTED.
  */
 static uintptr_t
-json_unescape(void *dst, void *src, size_t len)
+stream_buffer(void *dst, size_t dstcap, const void *src, size_t len,
+              bool decode, bool escape, int xtf8_err,
+              struct xtf8_stats *stats)
 {
-    uint8_t *d, *s, *end;
-    size_t sz;
-    bool escape;
+    xtf8_stream_t ctx;
+    uint8_t *d = dst;
+    size_t c, p;
+    stream_func f_stream;
+    flush_func f_flush;
+
+    (void)stream_funcs(decode, escape, len, &f_stream, &f_flush);
+    xtf8_stream_init(&ctx, xtf8_err);
+    xtf8_stream_stats(&ctx, stats);
+
+    if (f_stream(&ctx, d, dstcap, src, len, &c, &p) != 0)
+        return XTF8_ABORTED;
+    assert(c == len);
+    d += p;
+    if (f_flush(&ctx, d, dstcap - p, &p) != 0)
+        return XTF8_ABORTED;
+
+    return (uintptr_t)(d + p);
+}
 
-    d = dst;
-    end = (uint8_t *)src + len;
-    sz = 0;
-    escape = false;
-
-    for (s = src; s < end; s++) {
-        if (escape) {
-            switch (*s) {
-            case '\\':
-                sz++;
-                if (d != NULL)
-                    *d++ = '\\';
-                break;
-            case '"':
-                sz++;
-                if (d != NULL)
-                    *d++ = '"';
-                break;
 
-            case 'n':
-                sz++;
-                if (d != NULL)
-                    *d++ = '\n';
-                break;
-            case 'r':
-                sz++;
-                if (d != NULL)
-                    *d++ = '\r';
-                break;
-            case 't':
-                sz++;
-                if (d != NULL)
-                    *d++ = '\t';
-                break;
-            case 'b':
-                sz++;
-                if (d != NULL)
-                    *d++ = '\b';
-                break;
-            case 'f':
-                sz++;
-                if (d != NULL)
-                    *d++ = '\f';
-                break;
+/* Size of the output buffer in line mode, written when filled */
+#define LINE_BUFSIZE    (256 * 1024)
 
-            case 'u': /* u00XX */
-            {
-                uint32_t codepoint;
-                uint8_t x, ch;
-                int i;
+/*
+ * State of the line mode: the output buffer and the stream context of
+ * the current record.
+ */
+struct lines {
+    FILE *fp;
+    uint8_t *buf;
+    size_t len, cap;
+    bool decode;
+    int xtf8_err;
+    struct xtf8_stats *stats;
+    xtf8_stream_t ctx;
+    stream_func f_stream;
+    flush_func f_flush;
+    size_t lineno;
+};
 
-                if (s + 5 >= end) {
-                    DPRINTF("%s", "truncated \\u00XX sequence");
-                    return JSON_ERR_UNESCAPE;
-                }
-                for (codepoint = 0, i = 1; i < 5; i++) {
-                    ch = *(s + i);
-                    if (ch >= '0' && ch <= '9') {
-                        x = ch - '0';
-                    } else if (ch >= 'A' && ch <= 'F') {
-                        x = ch - 'A' + 10;
-                    } else if (ch >= 'a' && ch <= 'f') {
-                        /* Accept lowercase, although unspecified in RFC 8259 */
-                        x = ch - 'a' + 10;
-                    } else {
-                        DPRINTF("invalid xdigit in \\u00XX sequence: %.*s", 5, s);
-                        return JSON_ERR_UNESCAPE;
-                    }
-                    codepoint = (codepoint << 4) | x;
-                }
-                if (codepoint > 0x1F) {
-                    DPRINTF("out-of-range \\u00XX sequence: %.*s", 5, s);
-                    return JSON_ERR_UNESCAPE;
-                }
-                DPRINTF("unescaped \\%.*s to 0x%02X", 5, s, codepoint);
-                s += 4;
+/*
+ * Write out the buffered output once it's filled (or always if $force),
+ * so that the next operation always has enough room.
+ */
+static void
+lines_reserve(struct lines *l, bool force)
+{
+    double t;
 
-                sz++;
-                if (d != NULL)
-                    *d++ = (uint8_t)codepoint;
+    if (l->len == 0 || (!force && l->len <= LINE_BUFSIZE))
+        return;
 
-                break;
-            }
+    t = prof_begin();
+    if (fwrite(l->buf, 1, l->len, l->fp) != l->len)
+        err(1, "fwrite() failed");
+    prof_end(PHASE_WRITE, t, l->len);
+    DPRINTF("wrote %zu bytes", l->len);
+    l->len = 0;
+}
 
-            default:
-                DPRINTF("%s", "invalid escape sequence");
-                return JSON_ERR_UNESCAPE;
-            }
+static void
+lines_begin(struct lines *l)
+{
+    lines_reserve(l, false);
+    xtf8_stream_init(&l->ctx, l->xtf8_err);
+    xtf8_stream_stats(&l->ctx, l->stats);
+    if (!l->decode)
+        l->buf[l->len++] = '"';
+}
 
-            escape = false;
+static void
+lines_feed(struct lines *l, const void *src, size_t len)
+{
+    size_t c, p;
+
+    lines_reserve(l, false);
+    if (l->f_stream(&l->ctx, l->buf + l->len, l->cap - l->len, src, len,
+                    &c, &p) != 0)
+        errx(1, "line %zu: found invalid %s", l->lineno,
+             l->decode ? "JSON string" : "sequence");
+    assert(c == len);
+    l->len += p;
+}
 
-        } else if (*s == '\\') {
-            escape = true;
+static void
+lines_end(struct lines *l, char term)
+{
+    size_t p;
+
+    lines_reserve(l, false);
+    if (l->f_flush(&l->ctx, l->buf + l->len, l->cap - l->len, &p) != 0)
+        errx(1, "line %zu: found invalid %s", l->lineno,
+             l->decode ? "JSON string" : "sequence");
+    l->len += p;
+    if (!l->decode)
+        l->buf[l->len++] = '"';
+    l->buf[l->len++] = (uint8_t)term;
+    l->lineno++;
+}
 
+/*
+ * Encode every record of file $infp separated by $sep (newline or NUL)
+ * to a JSON string on its own line, i.e., NDJSON; or the reverse in
+ * decode mode, where the input lines are JSON strings and the decoded
+ * records are written terminated by $sep.  Empty lines are skipped in
+ * decode mode.
+ *
+ * The data are processed chunk by chunk in constant memory as
+ * stream_file() does (also taken from $map if not NULL), and the output
+ * is coalesced into large writes.  The statistics are collected into
+ * $stats if not NULL.
+ *
+ * Return the number of input bytes processed.
+ */
+static size_t
+line_file(FILE *infp, const uint8_t *map, size_t mapsize, FILE *outfp,
+          bool decode, char sep, int xtf8_err, struct xtf8_stats *stats)
+{
+    struct lines l;
+    const uint8_t *src, *s, *e, *q, *end;
+    uint8_t *ibuf;
+    size_t n, total, osize;
+    char isep, term;
+    bool eof, inrec, quote;
+    double t, tw;
+
+    memset(&l, 0, sizeof(l));
+    l.fp = outfp;
+    l.decode = decode;
+    l.xtf8_err = xtf8_err;
+    l.stats = stats;
+    l.lineno = 1;
+    osize = stream_funcs(decode, true, STREAM_BUFSIZE,
+                         &l.f_stream, &l.f_flush);
+    /* Room for one chunk, plus the flush, quotes and terminator */
+    l.cap = LINE_BUFSIZE + osize + 16;
+
+    ibuf = (map == NULL) ? prof_malloc(STREAM_BUFSIZE) : NULL;
+    l.buf = prof_malloc(l.cap);
+    if ((map == NULL && ibuf == NULL) || l.buf == NULL)
+        err(1, "failed to allocate line buffers");
+
+    /* The encoded records are always on their own lines. */
+    isep = decode ? '\n' : sep;
+    term = decode ? sep : '\n';
+    total = 0;
+    eof = inrec = quote = false;
+
+    while (!eof) {
+        if (map != NULL) {
+            n = mapsize - total;
+            if (n > STREAM_BUFSIZE)
+                n = STREAM_BUFSIZE;
+            src = map + total;
+            eof = (total + n == mapsize);
         } else {
-            sz++;
-            if (d != NULL)
-                *d++ = *s;
+            t = prof_begin();
+            n = fread(ibuf, 1, STREAM_BUFSIZE, infp);
+            if (n != STREAM_BUFSIZE) {
+                if (ferror(infp))
+                    err(1, "fread() failed");
+                eof = true;
+            }
+            prof_end(PHASE_READ, t, n);
+            src = ibuf;
         }
+        total += n;
+
+        /* The writes in between are accounted to their own phase. */
+        t = prof_begin();
+        tw = (prof != NULL) ? prof->secs[PHASE_WRITE] : 0.0;
+
+        for (s = src, e = src + n; s < e; s = end) {
+            q = memchr(s, isep, (size_t)(e - s));
+            end = (q != NULL) ? q : e;
+
+            if (!inrec) {
+                if (decode) {
+                    if (q == s) {
+                        /* Skip the empty line. */
+                        l.lineno++;
+                        end = q + 1;
+                        continue;
+                    }
+                    if (*s != '"')
+                        errx(1, "line %zu: not a JSON string", l.lineno);
+                    s++;
+                }
+                lines_begin(&l);
+                inrec = true;
+            }
+
+            if (decode) {
+                /*
+                 * Hold back a trailing quotation mark until it's known
+                 * whether it closes the string; otherwise feed it then,
+                 * to be unescaped or rejected by the decoder.
+                 */
+                if (quote && s < end) {
+                    lines_feed(&l, "\"", 1);
+                    quote = false;
+                }
+                if (end > s && end[-1] == '"') {
+                    lines_feed(&l, s, (size_t)(end - s) - 1);
+                    quote = true;
+                } else if (end > s) {
+                    lines_feed(&l, s, (size_t)(end - s));
+                }
+            } else if (end > s) {
+                lines_feed(&l, s, (size_t)(end - s));
+            }
+
+            if (q != NULL) {
+                if (decode && !quote)
+                    errx(1, "line %zu: unterminated JSON string", l.lineno);
+                quote = false;
+                lines_end(&l, term);
+                inrec = false;
+                end = q + 1;
+            }
+        }
+
+        if (prof != NULL)
+            t += prof->secs[PHASE_WRITE] - tw;
+        prof_end(PHASE_CODEC, t, n);
     }
 
-    if (escape) {
-        DPRINTF("%s", "incomplete escape sequence");
-        return JSON_ERR_UNESCAPE;
+    /* The last record may have no separator. */
+    if (inrec) {
+        if (decode && !quote)
+            errx(1, "line %zu: unterminated JSON string", l.lineno);
+        lines_end(&l, term);
     }
+    lines_reserve(&l, true);
+    fflush(outfp);
 
-    return (d != NULL) ? (uintptr_t)d : (uintptr_t)sz;
+    free(ibuf);
+    free(l.buf);
+
+    return total;
 }
 
 
 /*
- * Read from the given file $fp until EOF, and return the data,
- * with data length save in $size.
- *
- * The returned data must be free()'d after use.
+ * Print the statistics $stats of processing $len bytes in $secs seconds.
  */
-static void *
-read_file(FILE *fp, size_t *size)
+static void
+print_stats(FILE *fp, const struct xtf8_stats *stats, size_t len,
+            double secs)
 {
-    static size_t block_size = 1024;
-    unsigned char *buf, *tmp;
-    size_t n, sz, buf_size, tmp_size;
+    fprintf(fp, "Passthrough: %zu bytes\n", stats->passthrough);
+    fprintf(fp, "Binary: %zu bytes\n", stats->binary);
+    fprintf(fp, "Collisions: %zu\n", stats->collisions);
+    fprintf(fp, "Invalid: %zu\n", stats->invalid);
+    fprintf(fp, "Throughput: %zu bytes in %.3f s (%.1f MB/s)\n",
+            len, secs, (secs > 0) ? (double)len / secs / 1e6 : 0.0);
+}
 
-    buf = tmp = NULL;
-    buf_size = sz = 0;
 
-    do {
-        if (sz + block_size > buf_size) {
-            tmp_size = (buf_size == 0 ? block_size : buf_size * 2);
-            tmp = calloc(1, tmp_size);
-            if (tmp == NULL) {
-                fprintf(stderr, "%s: calloc() failed: %s\n",
-                        __func__, strerror(errno));
-                goto err;
-            }
+/* Interval of the checkpoints in the index file */
+#define INDEX_INTERVAL  (64 * 1024)
 
-            if (buf != NULL) {
-                memcpy(tmp, buf, buf_size);
-                free(buf);
-            }
+/*
+ * Build the checkpoint index of the encoded file $datafile and write it
+ * to $indexfile, as a header line followed by one line of the decoded
+ * and encoded offsets per checkpoint.
+ */
+static void
+write_index(const char *datafile, const char *indexfile, int xtf8_err)
+{
+    struct xtf8_checkpoint *index;
+    FILE *fp;
+    void *data;
+    size_t len, i;
+    uintptr_t n;
+    double t;
+
+    fp = fopen(datafile, "r");
+    if (fp == NULL)
+        err(1, "fopen(%s)", datafile);
+    data = map_file(fp, &len);
+    fclose(fp);
+
+    index = NULL;
+    n = 0;
+    if (data != NULL) {
+        t = prof_begin();
+        n = xtf8_index_build(NULL, 0, data, len, INDEX_INTERVAL, xtf8_err);
+        if (n == XTF8_ABORTED)
+            errx(1, "found invalid sequence in: %s", datafile);
+        index = prof_calloc((size_t)n, sizeof(*index));
+        if (index == NULL)
+            err(1, "failed to allocate index");
+        xtf8_index_build(index, (size_t)n, data, len, INDEX_INTERVAL,
+                         xtf8_err);
+        prof_end(PHASE_INDEX, t, len);
+        munmap(data, len);
+    }
+
+    fp = fopen(indexfile, "w");
+    if (fp == NULL)
+        err(1, "fopen(%s)", indexfile);
+    fprintf(fp, "xtf8-index 1 %d\n", INDEX_INTERVAL);
+    for (i = 0; i < (size_t)n; i++) {
+        fprintf(fp, "%" PRIu64 " %" PRIu64 "\n",
+                index[i].decoded, index[i].encoded);
+    }
+    if (fclose(fp) != 0)
+        err(1, "failed to write: %s", indexfile);
+
+    DPRINTF("wrote %zu checkpoints", (size_t)n);
+    free(index);
+}
 
-            buf = tmp;
-            buf_size = tmp_size;
-            DPRINTF("allocated buffer of size %zu", buf_size);
+/*
+ * Read the checkpoint index written by write_index() from $indexfile,
+ * with the number of checkpoints saved in $n.
+ *
+ * The returned index must be free()'d after use.
+ */
+static struct xtf8_checkpoint *
+read_index(const char *indexfile, size_t *n)
+{
+    struct xtf8_checkpoint *index, *tmp;
+    FILE *fp;
+    uint64_t decoded, encoded;
+    size_t size;
+    int version;
+
+    fp = fopen(indexfile, "r");
+    if (fp == NULL)
+        err(1, "fopen(%s)", indexfile);
+    if (fscanf(fp, "xtf8-index %d %*d", &version) != 1 || version != 1)
+        errx(1, "invalid index file: %s", indexfile);
+
+    index = NULL;
+    *n = size = 0;
+    while (fscanf(fp, "%" SCNu64 " %" SCNu64, &decoded, &encoded) == 2) {
+        if (*n == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            tmp = prof_realloc(index, size * sizeof(*index));
+            if (tmp == NULL)
+                err(1, "failed to allocate index");
+            index = tmp;
         }
+        if (*n > 0 && (decoded < index[*n - 1].decoded ||
+                       encoded <= index[*n - 1].encoded))
+            errx(1, "invalid index file: %s", indexfile);
+        index[*n].decoded = decoded;
+        index[*n].encoded = encoded;
+        (*n)++;
+    }
+    if (!feof(fp))
+        errx(1, "invalid index file: %s", indexfile);
 
-        n = fread(buf + sz, 1, block_size, fp);
-        sz += n;
-        DPRINTF("read %zu bytes", n);
+    fclose(fp);
+    return index;
+}
 
-        if (n != block_size) {
-            if (feof(fp)) {
-                break;
-            } else {
-                fprintf(stderr, "%s: fread() failed: %s\n",
-                        __func__, strerror(errno));
-                goto err;
-            }
-        };
 
-    } while (!feof(fp));
+/* Initial size of the per-worker buffers in batch mode */
+#define BATCH_BUFSIZE   (64 * 1024)
+
+/*
+ * The list of files processed by the batch mode.
+ */
+struct batch {
+    char **files;
+    size_t nfiles;
+    size_t next; /* index of the next file to take */
+    pthread_mutex_t lock;
+    const char *suffix; /* appended to the input path for the output */
+    uintptr_t (*f_xtf8)(void *, const void *, size_t, int);
+    size_t (*f_bound)(size_t);
+    int xtf8_err;
+};
+
+/*
+ * A worker of the batch mode, which keeps its buffers across the files
+ * so that they're only grown to fit the largest one.
+ */
+struct batch_worker {
+    struct batch *batch;
+    uint8_t *ibuf, *obuf;
+    size_t isize, osize;
+    char *path;
+    size_t psize;
+    size_t nfailed;
+};
+
+/*
+ * Grow the buffer $buf of size $size to hold at least $need bytes, and
+ * return the buffer, or NULL if failed (with $buf left intact).
+ */
+static void *
+batch_grow(void *buf, size_t *size, size_t need)
+{
+    void *p;
+    size_t sz;
+
+    if (*size >= need)
+        return buf;
+
+    sz = (*size == 0) ? BATCH_BUFSIZE : *size;
+    while (sz < need)
+        sz = (sz > SIZE_MAX / 2) ? need : sz * 2;
+
+    p = realloc(buf, sz);
+    if (p == NULL)
+        return NULL;
 
     *size = sz;
-    return buf;
+    return p;
+}
+
+/*
+ * Encode/decode the file $file to the file with the batch suffix
+ * appended, using the buffers of the worker $w.
+ */
+static bool
+batch_file(struct batch_worker *w, const char *file)
+{
+    struct batch *b = w->batch;
+    struct stat st;
+    size_t len, need, n, flen;
+    ssize_t nr, nw;
+    uintptr_t end;
+    void *p;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        warn("open(%s)", file);
+        return false;
+    }
+
+    /* Read the whole file, sized by fstat() if it's a regular file. */
+    need = BATCH_BUFSIZE;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uintmax_t)st.st_size < SIZE_MAX)
+        need = (size_t)st.st_size + 1; /* to see EOF without growing */
+    len = 0;
+    for (;;) {
+        p = batch_grow(w->ibuf, &w->isize, (len == 0) ? need : len + 1);
+        if (p == NULL) {
+            warnx("%s: failed to allocate input buffer", file);
+            goto err;
+        }
+        w->ibuf = p;
+        nr = read(fd, w->ibuf + len, w->isize - len);
+        if (nr == -1) {
+            if (errno == EINTR)
+                continue;
+            warn("read(%s)", file);
+            goto err;
+        }
+        if (nr == 0)
+            break;
+        len += (size_t)nr;
+    }
+    close(fd);
+    if (len == 0) {
+        /* Same as the single file mode */
+        warnx("failed to read from: %s", file);
+        return false;
+    }
+
+    /* One more byte, so that the output is never NULL. */
+    need = b->f_bound(len);
+    p = (need < SIZE_MAX) ? batch_grow(w->obuf, &w->osize, need + 1) : NULL;
+    if (p == NULL) {
+        warnx("%s: failed to allocate output buffer", file);
+        return false;
+    }
+    w->obuf = p;
+    end = b->f_xtf8(w->obuf, w->ibuf, len, b->xtf8_err);
+    if (end == XTF8_ABORTED) {
+        warnx("%s: found invalid input", file);
+        return false;
+    }
+    len = (size_t)(end - (uintptr_t)w->obuf);
+
+    flen = strlen(file);
+    need = flen + strlen(b->suffix) + 1;
+    p = batch_grow(w->path, &w->psize, need);
+    if (p == NULL) {
+        warnx("%s: failed to allocate path buffer", file);
+        return false;
+    }
+    w->path = p;
+    memcpy(w->path, file, flen);
+    memcpy(w->path + flen, b->suffix, need - flen);
+
+    fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        warn("open(%s)", w->path);
+        return false;
+    }
+    for (n = 0; n < len; n += (size_t)nw) {
+        nw = write(fd, w->obuf + n, len - n);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                nw = 0;
+                continue;
+            }
+            warn("write(%s)", w->path);
+            goto err;
+        }
+    }
+    if (close(fd) == -1) {
+        warn("close(%s)", w->path);
+        return false;
+    }
+
+    DPRINTF("%s -> %s (%zu bytes)", file, w->path, len);
+    return true;
 
 err:
-    if (buf)
-        free(buf);
+    close(fd);
+    return false;
+}
+
+static void *
+batch_work(void *arg)
+{
+    struct batch_worker *w = arg;
+    struct batch *b = w->batch;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next;
+        if (i < b->nfiles)
+            b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if (i >= b->nfiles)
+            break;
+        if (!batch_file(w, b->files[i]))
+            w->nfailed++;
+    }
+
     return NULL;
 }
 
+/*
+ * Process the files in $b by a pool of $nthreads workers, including the
+ * calling thread.  Return the number of files failed.
+ */
+static size_t
+batch_run(struct batch *b, unsigned long nthreads)
+{
+    struct batch_worker *workers;
+    pthread_t *tids;
+    bool *started;
+    size_t i, n, nfailed;
+
+    n = (nthreads < b->nfiles) ? (size_t)nthreads : b->nfiles;
+    if (n == 0)
+        return 0;
+
+    workers = calloc(n, sizeof(*workers));
+    tids = calloc(n, sizeof(*tids));
+    started = calloc(n, sizeof(*started));
+    if (workers == NULL || tids == NULL || started == NULL)
+        err(1, "failed to allocate workers");
+    if (pthread_mutex_init(&b->lock, NULL) != 0)
+        errx(1, "failed to initialize mutex");
+    b->next = 0;
+
+    for (i = 0; i < n; i++) {
+        workers[i].batch = b;
+        if (i > 0) {
+            started[i] = (pthread_create(&tids[i], NULL, batch_work,
+                                         &workers[i]) == 0);
+        }
+    }
+    /* The files left by any failed thread are taken by the others. */
+    batch_work(&workers[0]);
+
+    nfailed = 0;
+    for (i = 0; i < n; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        nfailed += workers[i].nfailed;
+        free(workers[i].ibuf);
+        free(workers[i].obuf);
+        free(workers[i].path);
+    }
+    DPRINTF("processed %zu files with %zu workers, %zu failed",
+            b->nfiles, n, nfailed);
+
+    pthread_mutex_destroy(&b->lock);
+    free(started);
+    free(tids);
+    free(workers);
+    return nfailed;
+}
 
 /*
- * Write the given $data of length $len to file $fp.
+ * Read the list of files separated by $sep from file $fp, with the
+ * number of files saved in $n, and the strings read into the arena
+ * $data.  Empty entries are skipped.
+ *
+ * The returned list must be free()'d, and the arena $data must be
+ * arena_free()'d after use.
  */
-static int
-write_file(FILE *fp, void *data, size_t len)
+static char **
+read_list(FILE *fp, char sep, size_t *n, struct arena *data)
 {
-    static size_t block_size = 1024;
-    unsigned char *d = data;
-    size_t n, nw, sz;
+    char *buf, *p, *q, *end, **files;
+    size_t len, i;
+
+    if (read_file(fp, data, &len) != 0)
+        errx(1, "failed to read the file list");
+    if (arena_reserve(data, len + 1) != 0)
+        errx(1, "failed to allocate file list");
+    buf = (char *)data->base;
+    buf[len] = '\0';
+    end = buf + len;
+
+    for (*n = 0, p = buf; p < end; p = q + 1) {
+        q = memchr(p, sep, (size_t)(end - p));
+        if (q == NULL)
+            q = end;
+        if (q > p)
+            (*n)++;
+    }
 
-    n = 0;
-    while (len > 0) {
-        sz = (len > block_size) ? block_size : len;
-        nw = fwrite(d + n, 1, sz, fp);
-        if (nw != sz) {
-            fprintf(stderr, "%s: fwrite() failed: %s\n",
-                    __func__, strerror(errno));
-            return -1;
-        }
-        n += nw;
-        len -= nw;
+    files = calloc(*n + 1, sizeof(*files));
+    if (files == NULL)
+        err(1, "failed to allocate file list");
+    for (i = 0, p = buf; p < end; p = q + 1) {
+        q = memchr(p, sep, (size_t)(end - p));
+        if (q == NULL)
+            q = end;
+        *q = '\0';
+        if (q > p)
+            files[i++] = p;
     }
 
-    fflush(fp);
-    return 0;
+    return files;
 }
 
 
@@ -397,6 +1394,7 @@ usage(void)
     fputs("XTF8 codec utility\n"
           "\n"
           "usage: xtf8 [OPTIONS]\n"
+          "       xtf8 -b <suffix> [-0] [-d] [-j] [-T <threads>] [file ...]\n"
           "\n"
           "options:\n"
           "    -d : decode mode instead of encode\n"
@@ -404,6 +1402,20 @@ usage(void)
           "    -o <outfile> : output file (stdout if unspecified)\n"
           "    -j : JSON escape the output (encode mode) or unescape the input (decode mode)\n"
           "    -x : hexdump the output\n"
+          "    -T <threads> : use threads for large input (not with -j or -s)\n"
+          "    -s : print the codec statistics and throughput to stderr\n"
+          "    -P <text|json> : print the time, bytes and throughput of every phase,\n"
+          "                     the peak RSS and the allocation count to stderr\n"
+          "    -I <index> : write the checkpoint index of the output (encode mode, needs -o),\n"
+          "                 or read it for -R (decode mode)\n"
+          "    -R <offset>,<length> : decode only the byte range of the original data\n"
+          "    -b <suffix> : batch mode; write every given file (or every file of the\n"
+          "                  newline-separated list on stdin) to <file><suffix>,\n"
+          "                  by a pool of threads (default: number of CPUs)\n"
+          "    -l : line mode; encode every line to a JSON string on its own line (NDJSON),\n"
+          "         or decode such lines back\n"
+          "    -0 : the file list on stdin (-b) or the input (output) records in line\n"
+          "         mode are NUL-separated\n"
           "    -D : show verbose debug messages\n"
           "\n",
           stderr);
@@ -415,26 +1427,62 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-    const char *infile, *outfile;
-    void *input, *output;
-    size_t inlen, outlen;
+    const char *infile, *outfile, *indexfile;
+    struct xtf8_checkpoint *index;
+    size_t nindex;
+    uint64_t range_off;
+    unsigned long long ull;
+    bool range, nulsep, lines;
+    const char *suffix;
+    struct batch batch;
+    size_t nfailed;
+    struct arena arena;
+    struct iovec iov[2];
+    void *input, *output, *map;
+    size_t inlen, outlen, maplen, range_len, skip, off;
     FILE *infp, *outfp;
-    bool debug, decode, escape, hex;
+    struct xtf8_stats stats;
+    static struct hexdump hd;
+    bool debug, decode, escape, hex, show_stats;
     int xtf8_err, opt;
+    unsigned long nthreads;
+    char *p;
+    double t0, t;
+    struct profile profile;
+    bool prof_json;
+    uintptr_t end;
     uintptr_t (*f_xtf8)(void *, const void *, size_t, int);
 
-    infile = outfile = NULL;
+    infile = outfile = indexfile = NULL;
+    index = NULL;
+    nindex = 0;
+    range = false;
+    range_off = 0;
+    range_len = 0;
     infp = outfp = NULL;
-    debug = decode = escape = hex = false;
-    input = output = NULL;
+    debug = decode = escape = hex = show_stats = false;
+    memset(&stats, 0, sizeof(stats));
+    input = output = map = NULL;
+    maplen = 0;
+    nthreads = 0; /* unspecified */
+    suffix = NULL;
+    memset(&arena, 0, sizeof(arena));
+    prof_json = false;
+    nulsep = lines = false;
     xtf8_err = XTF8_ERR_REPLACE;
     f_xtf8 = xtf8_encode;
 
-    while ((opt = getopt(argc, argv, "Ddhi:jo:x")) != -1) {
+    while ((opt = getopt(argc, argv, "0DI:P:R:T:b:dhi:jlo:sx")) != -1) {
         switch (opt) {
+        case '0':
+            nulsep = true;
+            break;
         case 'D':
             debug = true;
             break;
+        case 'b':
+            suffix = optarg;
+            break;
         case 'd':
             decode = true;
             f_xtf8 = xtf8_decode;
@@ -445,12 +1493,47 @@ main(int argc, char *argv[])
         case 'j':
             escape = true;
             break;
+        case 'l':
+            lines = true;
+            break;
         case 'o':
             outfile = optarg;
             break;
+        case 's':
+            show_stats = true;
+            break;
+        case 'I':
+            indexfile = optarg;
+            break;
+        case 'P':
+            if (strcmp(optarg, "json") == 0)
+                prof_json = true;
+            else if (strcmp(optarg, "text") != 0)
+                errx(1, "invalid profile format: %s", optarg);
+            memset(&profile, 0, sizeof(profile));
+            prof = &profile;
+            break;
+        case 'R':
+            errno = 0;
+            ull = strtoull(optarg, &p, 10);
+            if (*optarg == '\0' || *p != ',' || errno != 0)
+                errx(1, "invalid range: %s", optarg);
+            range_off = (uint64_t)ull;
+            ull = strtoull(p + 1, &p, 10);
+            if (*p != '\0' || errno != 0 || ull > SIZE_MAX)
+                errx(1, "invalid range: %s", optarg);
+            range_len = (size_t)ull;
+            range = true;
+            break;
         case 'x':
             hex = true;
             break;
+        case 'T':
+            nthreads = strtoul(optarg, &p, 10);
+            if (*optarg == '\0' || *p != '\0' || nthreads == 0 ||
+                nthreads > UINT_MAX)
+                errx(1, "invalid number of threads: %s", optarg);
+            break;
         case 'h':
         default:
             usage();
@@ -459,12 +1542,69 @@ main(int argc, char *argv[])
     }
 
     argc -= optind;
-    if (argc != 0) {
+    argv += optind;
+    if (argc != 0 && suffix == NULL) {
         fprintf(stderr, "ERROR: received extra arguments.\n");
         usage();
         /* NOTREACHED */
     }
 
+    if (lines && (suffix != NULL || indexfile != NULL || range || hex))
+        errx(1, "-l can't be used with -b, -I, -R or -x");
+
+    if (suffix != NULL) {
+        if (infile != NULL || outfile != NULL || indexfile != NULL ||
+            range || hex || show_stats || prof != NULL)
+            errx(1, "-b can't be used with -i, -o, -I, -R, -x, -s or -P");
+        if (*suffix == '\0')
+            errx(1, "empty batch suffix");
+
+        memset(&batch, 0, sizeof(batch));
+        batch.suffix = suffix;
+        batch.xtf8_err = xtf8_err;
+        if (decode) {
+            batch.f_xtf8 = escape ? xtf8_decode_json : xtf8_decode;
+            batch.f_bound = xtf8_decode_bound;
+        } else {
+            batch.f_xtf8 = escape ? xtf8_encode_json : xtf8_encode;
+            batch.f_bound = (escape ? xtf8_encode_json_bound :
+                             xtf8_encode_bound);
+        }
+        if (argc != 0) {
+            batch.files = argv;
+            batch.nfiles = (size_t)argc;
+        } else {
+            batch.files = read_list(stdin, (nulsep ? '\0' : '\n'),
+                                    &batch.nfiles, &arena);
+        }
+
+        if (nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = (ncpu > 0) ? (unsigned long)ncpu : 1;
+#else
+            nthreads = 1;
+#endif
+        }
+
+        nfailed = batch_run(&batch, nthreads);
+        if (argc == 0)
+            free(batch.files);
+        arena_free(&arena);
+        if (nfailed > 0)
+            errx(1, "failed to process %zu of %zu files",
+                 nfailed, batch.nfiles);
+        return 0;
+    }
+
+    if (nthreads == 0)
+        nthreads = 1;
+
+    if (range && (!decode || escape))
+        errx(1, "-R works only in decode mode and not with -j");
+    if (indexfile != NULL && !decode && (outfile == NULL || escape))
+        errx(1, "-I in encode mode needs -o and not -j");
+
     if (debug) {
         fprintf(stderr, "Mode: %s\n", decode ? "decode" : "encode");
         fprintf(stderr, "Input: %s\n", infile ? infile : "<stdin>");
@@ -473,6 +1613,7 @@ main(int argc, char *argv[])
                 escape ?
                 (decode ? "unescape input" : "escape output") :
                 "(none)");
+        fprintf(stderr, "Threads: %lu\n", nthreads);
     }
 
     if (infile != NULL) {
@@ -486,93 +1627,196 @@ main(int argc, char *argv[])
             err(1, "fopen(%s)", outfile);
     }
 
-    input = read_file((infp ? infp : stdin), &inlen);
-    if (input == NULL || inlen == 0)
-        errx(1, "failed to read from: %s", infp ? infile : "stdin");
-
-    if (debug) {
-        fprintf(stderr, "Input: (len=%zu)\n", inlen);
-        hexdump(stderr, input, inlen);
+    t0 = now();
+
+    /* Regular input file is mapped and used in place. */
+    t = prof_begin();
+    map = (infp != NULL) ? map_file(infp, &maplen) : NULL;
+    prof_end(PHASE_READ, t, maplen);
+
+    if (lines) {
+        inlen = line_file((infp ? infp : stdin), map, maplen,
+                          (outfp ? outfp : stdout), decode,
+                          (nulsep ? '\0' : '\n'), xtf8_err,
+                          (show_stats ? &stats : NULL));
+        if (show_stats)
+            print_stats(stderr, &stats, inlen, now() - t0);
+        goto out;
     }
 
-    if (escape && decode) {
-        /* JSON unescape input. */
-        void *jbuf;
-        size_t jlen;
+    if (range) {
+        /* Decode only the requested range of the original data. */
+        if (indexfile != NULL)
+            index = read_index(indexfile, &nindex);
+        if (map != NULL) {
+            input = map;
+            inlen = maplen;
+            off = 0;
+        } else {
+            t = prof_begin();
+            if (read_file((infp ? infp : stdin), &arena, &inlen) != 0)
+                errx(1, "failed to read from: %s", infp ? infile : "stdin");
+            input = arena.base;
+            prof_end(PHASE_READ, t, inlen);
+            off = ARENA_ALIGN(inlen);
+        }
+        outlen = xtf8_decode_bound(inlen);
+        if (range_len < outlen)
+            outlen = range_len;
+        /* The output follows the input in the same arena. */
+        if (arena_reserve(&arena, off + outlen) != 0)
+            errx(1, "failed to allocate output buffer");
+        if (input != map)
+            input = arena.base;
+        output = arena.base + off;
+
+        t = prof_begin();
+        end = xtf8_decode_range(output, input, inlen, index, nindex,
+                                range_off, outlen, xtf8_err);
+        if (end == XTF8_ABORTED)
+            errx(1, "found invalid sequence");
+        outlen = (size_t)(end - (uintptr_t)output);
+        prof_end(PHASE_CODEC, t, outlen);
+        DPRINTF("decoded range: offset=%" PRIu64 ", length=%zu",
+                range_off, outlen);
+
+        t = prof_begin();
+        iov[0].iov_base = output;
+        iov[0].iov_len = outlen;
+        if (hex)
+            hexdump_iov(stdout, iov, 1);
+        else if (write_file((outfile ? outfp : stdout), iov, 1) != 0)
+            exit(EXIT_FAILURE);
+        prof_end(hex ? PHASE_HEXDUMP : PHASE_WRITE, t, outlen);
+
+        free(index);
+        goto out;
+    }
 
-        jlen = (size_t)json_unescape(NULL, input, inlen);
-        if ((uintptr_t)jlen == JSON_ERR_UNESCAPE)
-            errx(1, "failed to unescape JSON string");
+    if (!debug && (nthreads == 1 || escape || show_stats)) {
+        /* Nothing to debug, so process the data as a stream. */
+        if (hex)
+            hexdump_init(&hd, stdout);
+        inlen = stream_file((infp ? infp : stdin), map, maplen,
+                            (outfp ? outfp : stdout), decode, escape,
+                            xtf8_err, (show_stats ? &stats : NULL),
+                            (hex ? &hd : NULL));
+        if (inlen == 0)
+            errx(1, "failed to read from: %s", infp ? infile : "stdin");
+        if (hex) {
+            t = prof_begin();
+            hexdump_end(&hd);
+            prof_end(PHASE_HEXDUMP, t, 0);
+        }
+        if (show_stats)
+            print_stats(stderr, &stats, inlen, now() - t0);
+        goto out;
+    }
 
-        jbuf = calloc(1, jlen);
-        if (jbuf == NULL)
-            err(1, "failed to allocate JSON buffer");
+    /* Only to debug or to split the work between threads from here on. */
+    if (map != NULL) {
+        input = map;
+        inlen = maplen;
+    } else {
+        t = prof_begin();
+        if (read_file((infp ? infp : stdin), &arena, &inlen) != 0 ||
+            inlen == 0)
+            errx(1, "failed to read from: %s", infp ? infile : "stdin");
+        input = arena.base;
+        prof_end(PHASE_READ, t, inlen);
+    }
 
-        (void)json_unescape(jbuf, input, inlen);
+    if (debug) {
+        fprintf(stderr, "Input: (len=%zu)\n", inlen);
+        hexdump(stderr, input, inlen);
+    }
 
-        free(input);
-        input = jbuf;
-        inlen = jlen;
+    t = prof_begin();
+    skip = 0;
+    if (escape) {
+        /* JSON escape the output or unescape the input in one pass. */
+        f_xtf8 = decode ? xtf8_decode_json : xtf8_encode_json;
+        outlen = (decode ? xtf8_decode_bound(inlen) :
+                  xtf8_encode_json_bound(inlen));
+    } else {
+        /*
+         * In the single pass, the leading part that needs no change
+         * is written straight from the input instead of copied.
+         */
+        if (nthreads == 1 && !show_stats)
+            skip = xtf8_scan(input, inlen);
+        outlen = (decode ? xtf8_decode_bound(inlen - skip) :
+                  xtf8_encode_bound(inlen - skip));
+    }
 
-        if (debug) {
-            fprintf(stderr, "JSON-unescaped input: (len=%zu)\n", inlen);
-            hexdump(stderr, input, inlen);
+    /* The output follows the input in the same arena. */
+    off = (input == map) ? 0 : ARENA_ALIGN(inlen);
+    if (arena_reserve(&arena, off + outlen) != 0)
+        errx(1, "failed to allocate output buffer");
+    if (input != map)
+        input = arena.base;
+    output = arena.base + off;
+
+    if (show_stats) {
+        end = stream_buffer(output, outlen, input, inlen, decode,
+                            escape, xtf8_err, &stats);
+    } else if (nthreads > 1 && !escape) {
+        if (decode) {
+            end = xtf8_decode_parallel(output, input, inlen, xtf8_err,
+                                       (unsigned int)nthreads);
+        } else {
+            end = xtf8_encode_parallel(output, input, inlen, xtf8_err,
+                                       (unsigned int)nthreads);
         }
+    } else {
+        end = f_xtf8(output, (const uint8_t *)input + skip,
+                     inlen - skip, xtf8_err);
     }
-
-    outlen = (size_t)f_xtf8(NULL, input, inlen, xtf8_err);
-    assert((uintptr_t)outlen != XTF8_ABORTED);
+    if (end == XTF8_ABORTED)
+        errx(1, "found invalid %s", escape ? "JSON string" : "sequence");
+    iov[0].iov_base = input;
+    iov[0].iov_len = skip;
+    iov[1].iov_base = output;
+    iov[1].iov_len = (size_t)(end - (uintptr_t)output);
+    outlen = skip + iov[1].iov_len;
+    prof_end(PHASE_CODEC, t, inlen);
     if (debug) {
         fprintf(stderr, "XTF8 %s size: %zu -> %zu\n",
-                (decode ? "decoded" : "encoded"),
+                (decode ?
+                 (escape ? "JSON-unescaped and decoded" : "decoded") :
+                 (escape ? "encoded and JSON-escaped" : "encoded")),
                 inlen, outlen);
     }
 
-    output = calloc(1, outlen);
-    if (output == NULL)
-        err(1, "failed to allocate output buffer");
-
-    (void)f_xtf8(output, input, inlen, xtf8_err);
-
     if (debug) {
         fprintf(stderr, "Output: (len=%zu)\n", outlen);
-        hexdump(stderr, output, outlen);
-    }
-
-    if (escape && !decode) {
-        /* JSON escape encoded output. */
-        void *jbuf;
-        size_t jlen;
-
-        jlen = (size_t)json_escape(NULL, output, outlen);
-        jbuf = calloc(1, jlen);
-        if (jbuf == NULL)
-            err(1, "failed to allocate JSON buffer");
-
-        (void)json_escape(jbuf, output, outlen);
-
-        free(output);
-        output = jbuf;
-        outlen = jlen;
-
-        if (debug) {
-            fprintf(stderr, "JSON-escaped output: (len=%zu)\n", outlen);
-            hexdump(stderr, output, outlen);
-        }
+        hexdump_iov(stderr, iov, 2);
     }
 
+    t = prof_begin();
     if (hex)
-        hexdump(stdout, output, outlen);
-    else
-        write_file((outfile ? outfp : stdout), output, outlen);
-
-    free(input);
-    free(output);
-
+        hexdump_iov(stdout, iov, 2);
+    else if (write_file((outfile ? outfp : stdout), iov, 2) != 0)
+        exit(EXIT_FAILURE);
+    prof_end(hex ? PHASE_HEXDUMP : PHASE_WRITE, t, outlen);
+
+    if (show_stats)
+        print_stats(stderr, &stats, inlen, now() - t0);
+
+out:
+    arena_free(&arena);
+    if (map != NULL)
+        munmap(map, maplen);
     if (infp != NULL)
         fclose(infp);
-    if (outfp != NULL)
-        fclose(outfp);
+    if (outfp != NULL && fclose(outfp) != 0)
+        err(1, "failed to write: %s", outfile);
+
+    if (indexfile != NULL && !decode)
+        write_index(outfile, indexfile, xtf8_err);
+
+    if (prof != NULL)
+        print_profile(stderr, prof, now() - t0, prof_json);
 
     return 0;
 }
@@ -0,0 +1,1030 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022-2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XTF8_X86    1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define XTF8_NEON   1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h> /* getauxval() */
+#include <asm/hwcap.h> /* HWCAP_ASIMD */
+#endif
+#endif
+
+#include "xtf8_simd.h"
+
+
+#ifdef XTF8_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+
+/*
+ * Portable fallback: check a machine word at a time.
+ */
+static size_t
+ascii_scalar(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, s + i, sizeof(w));
+        if ((w & UINT64_C(0x8080808080808080)) != 0)
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * Check whether any byte in the word $w needs JSON escaping, i.e.,
+ * control characters (< 0x20), quotation mark (") and reverse solidus.
+ */
+static inline bool
+json_word(uint64_t w)
+{
+    const uint64_t ones = UINT64_C(0x0101010101010101);
+    const uint64_t high = UINT64_C(0x8080808080808080);
+    uint64_t q, b;
+
+    q = w ^ (ones * '"');
+    b = w ^ (ones * '\\');
+    return ((((w - ones * 0x20) & ~w) |
+             ((q - ones) & ~q) |
+             ((b - ones) & ~b)) & high) != 0;
+}
+
+static size_t
+json_scalar(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, s + i, sizeof(w));
+        if (json_word(w))
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * No portable way to do it faster than the caller's table lookup.
+ */
+static size_t
+binary_scalar(void *dst, const void *src, size_t len)
+{
+    (void)dst;
+    (void)src;
+    (void)len;
+    return 0;
+}
+
+/*
+ * Leave ASCII to the caller's loop, which is just as fast without SIMD.
+ */
+static size_t
+widen_scalar(uint16_t *dst, const void *src, size_t len)
+{
+    (void)dst;
+    (void)src;
+    (void)len;
+    return 0;
+}
+
+static size_t
+narrow_scalar(void *dst, const uint16_t *src, size_t len)
+{
+    (void)dst;
+    (void)src;
+    (void)len;
+    return 0;
+}
+
+/*
+ * Leave it to the caller's DFA.
+ */
+static size_t
+utf8_scalar(const void *src, size_t len, size_t *npua)
+{
+    (void)src;
+    (void)len;
+    (void)npua;
+    return 0;
+}
+
+
+#if defined(XTF8_X86) || defined(XTF8_NEON)
+
+/*
+ * Error classes of a pair of adjacent bytes for the UTF-8 validation by
+ * table lookups (John Keiser and Daniel Lemire, "Validating UTF-8 in
+ * less than one instruction per byte", 2021): a pair is invalid if the
+ * classes looked up by the high and low nibbles of the first byte and
+ * the high nibble of the second byte have any bit in common.
+ */
+#define U8_TOO_SHORT    0x01 /* lead followed by a non-continuation */
+#define U8_TOO_LONG     0x02 /* ASCII followed by a continuation */
+#define U8_OVERLONG_3   0x04 /* E0 80..9F */
+#define U8_TOO_LARGE    0x08 /* F4 90..BF, F5..FF 90..BF */
+#define U8_SURROGATE    0x10 /* ED A0..BF */
+#define U8_OVERLONG_2   0x20 /* C0..C1 80..BF */
+#define U8_TOO_LARGE_80 0x40 /* F5..FF 80..8F */
+#define U8_OVERLONG_4   0x40 /* F0 80..8F */
+#define U8_TWO_CONTS    0x80 /* continuation followed by a continuation */
+#define U8_CARRY        (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+static const uint8_t utf8_lookup[3][16] = {
+    /* High nibble of the first byte */
+    {
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_80 | U8_OVERLONG_4,
+    },
+    /* Low nibble of the first byte */
+    {
+        U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+        U8_CARRY | U8_OVERLONG_2,
+        U8_CARRY,
+        U8_CARRY,
+        U8_CARRY | U8_TOO_LARGE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80 | U8_SURROGATE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_80,
+    },
+    /* High nibble of the second byte */
+    {
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+            U8_TOO_LARGE_80 | U8_OVERLONG_4,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+            U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE |
+            U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE |
+            U8_TOO_LARGE,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    },
+};
+
+/*
+ * A block is incomplete if any of its last 3 bytes begins a sequence
+ * that doesn't fit, i.e., if it's greater than the matching byte here.
+ */
+static const uint8_t utf8_incomplete[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+#endif
+
+
+#ifdef XTF8_X86
+
+TARGET("sse2")
+static size_t
+ascii_sse2(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m128i v0, v1, v2, v3;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        v0 = _mm_loadu_si128((const __m128i *)(s + i));
+        v1 = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        v2 = _mm_loadu_si128((const __m128i *)(s + i + 32));
+        v3 = _mm_loadu_si128((const __m128i *)(s + i + 48));
+        v0 = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+        if (_mm_movemask_epi8(v0) != 0)
+            break;
+    }
+    for (; i + 16 <= len; i += 16) {
+        v0 = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v0) != 0)
+            break;
+    }
+
+    return i;
+}
+
+TARGET("avx2")
+static size_t
+ascii_avx2(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m256i v0, v1;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        v0 = _mm256_loadu_si256((const __m256i *)(s + i));
+        v1 = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+        if (_mm256_movemask_epi8(_mm256_or_si256(v0, v1)) != 0)
+            break;
+    }
+    for (; i + 32 <= len; i += 32) {
+        v0 = _mm256_loadu_si256((const __m256i *)(s + i));
+        if (_mm256_movemask_epi8(v0) != 0)
+            break;
+    }
+
+    return i;
+}
+
+TARGET("avx512f,avx512bw")
+static size_t
+ascii_avx512(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m512i v0, v1;
+    size_t i;
+
+    for (i = 0; i + 128 <= len; i += 128) {
+        v0 = _mm512_loadu_si512((const void *)(s + i));
+        v1 = _mm512_loadu_si512((const void *)(s + i + 64));
+        if (_mm512_movepi8_mask(_mm512_or_si512(v0, v1)) != 0)
+            break;
+    }
+    for (; i + 64 <= len; i += 64) {
+        v0 = _mm512_loadu_si512((const void *)(s + i));
+        if (_mm512_movepi8_mask(v0) != 0)
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * Return a mask of bytes in the vector $v that need JSON escaping.
+ */
+TARGET("sse2")
+static inline int
+json_mask_sse2(__m128i v)
+{
+    __m128i m;
+
+    /* Unsigned (v <= 0x1F) as (max(v, 0x1F) == 0x1F) */
+    m = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1F)),
+                       _mm_set1_epi8(0x1F));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    return _mm_movemask_epi8(m);
+}
+
+TARGET("sse2")
+static size_t
+json_sse2(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m128i v;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (json_mask_sse2(v) != 0)
+            break;
+    }
+
+    return i;
+}
+
+TARGET("avx2")
+static inline int
+json_mask_avx2(__m256i v)
+{
+    __m256i m;
+
+    m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1F)),
+                          _mm256_set1_epi8(0x1F));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    return _mm256_movemask_epi8(m);
+}
+
+TARGET("avx2")
+static size_t
+json_avx2(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+        if (json_mask_avx2(v) != 0)
+            break;
+    }
+
+    return i;
+}
+
+TARGET("avx512f,avx512bw")
+static inline __mmask64
+json_mask_avx512(__m512i v)
+{
+    return _mm512_cmple_epu8_mask(v, _mm512_set1_epi8(0x1F)) |
+           _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"')) |
+           _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+}
+
+TARGET("avx512f,avx512bw")
+static size_t
+json_avx512(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m512i v;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        v = _mm512_loadu_si512((const void *)(s + i));
+        if (json_mask_avx512(v) != 0)
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * Shuffle indexes to interleave the 16 encoded bytes into 16 triplets of
+ * <EE, mid, low> in 3 vectors: for every output vector, the indexes into
+ * the mid bytes, then into the low bytes, and the EE bytes to merge.
+ */
+static const uint8_t binary_shuffle[3][3][16] = {
+    {
+        { 0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02,
+          0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80 },
+        { 0x80, 0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80,
+          0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80 },
+        { 0xEE, 0x00, 0x00, 0xEE, 0x00, 0x00, 0xEE, 0x00,
+          0x00, 0xEE, 0x00, 0x00, 0xEE, 0x00, 0x00, 0xEE },
+    },
+    {
+        { 0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80,
+          0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0A },
+        { 0x80, 0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07,
+          0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80 },
+        { 0x00, 0x00, 0xEE, 0x00, 0x00, 0xEE, 0x00, 0x00,
+          0xEE, 0x00, 0x00, 0xEE, 0x00, 0x00, 0xEE, 0x00 },
+    },
+    {
+        { 0x80, 0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80, 0x80,
+          0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F, 0x80 },
+        { 0x0A, 0x80, 0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80,
+          0x80, 0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F },
+        { 0x00, 0xEE, 0x00, 0x00, 0xEE, 0x00, 0x00, 0xEE,
+          0x00, 0x00, 0xEE, 0x00, 0x00, 0xEE, 0x00, 0x00 },
+    },
+};
+
+/*
+ * Used by the ssse3, avx2 and avx512bw kernels, since the expansion is
+ * bound by the shuffles within 128-bit lanes anyway.
+ */
+TARGET("ssse3")
+static size_t
+binary_ssse3(void *dst, const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    __m128i v, x, m, mid, low, o;
+    size_t i, k;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+
+        /*
+         * Signed (v - 0x80) is negative for ASCII, 0x00..0x41 for
+         * 0x80..0xC1, and 0x75..0x7F for 0xF5..0xFF.
+         */
+        x = _mm_sub_epi8(v, _mm_set1_epi8((char)0x80));
+        m = _mm_or_si128(_mm_cmpgt_epi8(_mm_set1_epi8(0x42), x),
+                         _mm_cmpgt_epi8(x, _mm_set1_epi8(0x74)));
+        m = _mm_andnot_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), x), m);
+        if (_mm_movemask_epi8(m) != 0xFFFF)
+            break;
+
+        /* U+EF80..U+EFFF: <EE, BE | bit6, 80 | bits0-5> */
+        mid = _mm_add_epi8(_mm_and_si128(_mm_srli_epi16(v, 6),
+                                         _mm_set1_epi8(1)),
+                           _mm_set1_epi8((char)0xBE));
+        low = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi8(0x3F)),
+                           _mm_set1_epi8((char)0x80));
+
+        for (k = 0; k < 3; k++) {
+            o = _mm_or_si128(
+                    _mm_shuffle_epi8(mid, _mm_loadu_si128(
+                        (const __m128i *)binary_shuffle[k][0])),
+                    _mm_shuffle_epi8(low, _mm_loadu_si128(
+                        (const __m128i *)binary_shuffle[k][1])));
+            o = _mm_or_si128(o, _mm_loadu_si128(
+                    (const __m128i *)binary_shuffle[k][2]));
+            _mm_storeu_si128((__m128i *)(d + i * 3 + k * 16), o);
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Validate 32-byte blocks with the lookup method (see utf8_lookup[]),
+ * and count the PUA lead pairs EE BE/BF on the way.  The result only
+ * advances past blocks that end at a character boundary.
+ *
+ * Also used by the avx512bw kernel, since the lookups are bound by the
+ * shuffles within 128-bit lanes anyway.
+ */
+TARGET("avx2")
+static size_t
+utf8_avx2(const void *src, size_t len, size_t *npua)
+{
+    const uint8_t *s = src;
+    __m256i t1, t2, t3, lim, nib, v, prev, inc, p1, p2, p3, e, m;
+    size_t i, good, count, count_good;
+
+    t1 = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)utf8_lookup[0]));
+    t2 = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)utf8_lookup[1]));
+    t3 = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)utf8_lookup[2]));
+    lim = _mm256_loadu_si256((const __m256i *)utf8_incomplete);
+    nib = _mm256_set1_epi8(0x0F);
+
+    prev = inc = _mm256_setzero_si256();
+    good = count = count_good = 0;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+        if (_mm256_movemask_epi8(v) == 0) {
+            /* ASCII block; only valid if the previous one completed. */
+            if (!_mm256_testz_si256(inc, inc))
+                break;
+            prev = v;
+            good = i + 32;
+            continue;
+        }
+
+        /* Previous 1..3 bytes of every byte */
+        m = _mm256_permute2x128_si256(prev, v, 0x21);
+        p1 = _mm256_alignr_epi8(v, m, 15);
+        p2 = _mm256_alignr_epi8(v, m, 14);
+        p3 = _mm256_alignr_epi8(v, m, 13);
+
+        e = _mm256_and_si256(
+                _mm256_shuffle_epi8(t1, _mm256_and_si256(
+                    _mm256_srli_epi16(p1, 4), nib)),
+                _mm256_shuffle_epi8(t2, _mm256_and_si256(p1, nib)));
+        e = _mm256_and_si256(e, _mm256_shuffle_epi8(t3, _mm256_and_si256(
+                    _mm256_srli_epi16(v, 4), nib)));
+
+        /* 3rd and 4th bytes must be continuations (TWO_CONTS) exactly. */
+        m = _mm256_or_si256(
+                _mm256_subs_epu8(p2, _mm256_set1_epi8(0xE0 - 0x80)),
+                _mm256_subs_epu8(p3, _mm256_set1_epi8(0xF0 - 0x80)));
+        e = _mm256_xor_si256(e, _mm256_and_si256(m,
+                    _mm256_set1_epi8((char)0x80)));
+        if (!_mm256_testz_si256(e, e))
+            break;
+
+        m = _mm256_and_si256(
+                _mm256_cmpeq_epi8(p1, _mm256_set1_epi8((char)0xEE)),
+                _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(1)),
+                                  _mm256_set1_epi8((char)0xBF)));
+        count += (size_t)__builtin_popcount(
+                (unsigned int)_mm256_movemask_epi8(m));
+
+        inc = _mm256_subs_epu8(v, lim);
+        prev = v;
+        if (_mm256_testz_si256(inc, inc)) {
+            good = i + 32;
+            count_good = count;
+        }
+    }
+
+    *npua += count_good;
+    return good;
+}
+
+/*
+ * See utf8_avx2(); the same in 16-byte blocks for CPUs without AVX2.
+ */
+TARGET("ssse3")
+static size_t
+utf8_ssse3(const void *src, size_t len, size_t *npua)
+{
+    const uint8_t *s = src;
+    __m128i t1, t2, t3, lim, nib, zero, v, prev, inc, p1, p2, p3, e, m;
+    size_t i, good, count, count_good;
+
+    t1 = _mm_loadu_si128((const __m128i *)utf8_lookup[0]);
+    t2 = _mm_loadu_si128((const __m128i *)utf8_lookup[1]);
+    t3 = _mm_loadu_si128((const __m128i *)utf8_lookup[2]);
+    lim = _mm_loadu_si128((const __m128i *)(utf8_incomplete + 16));
+    nib = _mm_set1_epi8(0x0F);
+    zero = _mm_setzero_si128();
+
+    prev = inc = zero;
+    good = count = count_good = 0;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+
+        if (_mm_movemask_epi8(v) == 0) {
+            /* ASCII block; only valid if the previous one completed. */
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(inc, zero)) != 0xFFFF)
+                break;
+            prev = v;
+            good = i + 16;
+            continue;
+        }
+
+        /* Previous 1..3 bytes of every byte */
+        p1 = _mm_alignr_epi8(v, prev, 15);
+        p2 = _mm_alignr_epi8(v, prev, 14);
+        p3 = _mm_alignr_epi8(v, prev, 13);
+
+        e = _mm_and_si128(
+                _mm_shuffle_epi8(t1, _mm_and_si128(
+                    _mm_srli_epi16(p1, 4), nib)),
+                _mm_shuffle_epi8(t2, _mm_and_si128(p1, nib)));
+        e = _mm_and_si128(e, _mm_shuffle_epi8(t3, _mm_and_si128(
+                    _mm_srli_epi16(v, 4), nib)));
+
+        /* 3rd and 4th bytes must be continuations (TWO_CONTS) exactly. */
+        m = _mm_or_si128(_mm_subs_epu8(p2, _mm_set1_epi8(0xE0 - 0x80)),
+                         _mm_subs_epu8(p3, _mm_set1_epi8(0xF0 - 0x80)));
+        e = _mm_xor_si128(e, _mm_and_si128(m, _mm_set1_epi8((char)0x80)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(e, zero)) != 0xFFFF)
+            break;
+
+        m = _mm_and_si128(
+                _mm_cmpeq_epi8(p1, _mm_set1_epi8((char)0xEE)),
+                _mm_cmpeq_epi8(_mm_or_si128(v, _mm_set1_epi8(1)),
+                               _mm_set1_epi8((char)0xBF)));
+        count += (size_t)__builtin_popcount(
+                (unsigned int)_mm_movemask_epi8(m));
+
+        inc = _mm_subs_epu8(v, lim);
+        prev = v;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(inc, zero)) == 0xFFFF) {
+            good = i + 16;
+            count_good = count;
+        }
+    }
+
+    *npua += count_good;
+    return good;
+}
+
+TARGET("sse2")
+static size_t
+widen_sse2(uint16_t *dst, const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m128i v, z;
+    size_t i;
+
+    z = _mm_setzero_si128();
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(v, z));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, z));
+    }
+
+    return i;
+}
+
+TARGET("sse2")
+static size_t
+narrow_sse2(void *dst, const uint16_t *src, size_t len)
+{
+    uint8_t *d = dst;
+    __m128i a, b, m;
+    size_t i;
+
+    m = _mm_set1_epi16((short)0xFF80);
+    for (i = 0; i + 16 <= len; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(src + i));
+        b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+                _mm_and_si128(_mm_or_si128(a, b), m),
+                _mm_setzero_si128())) != 0xFFFF)
+            break;
+        _mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(a, b));
+    }
+
+    return i;
+}
+
+TARGET("avx2")
+static size_t
+widen_avx2(uint16_t *dst, const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+        if (_mm256_movemask_epi8(v) != 0)
+            break;
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_cvtepu8_epi16(
+                                _mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i *)(dst + i + 16),
+                            _mm256_cvtepu8_epi16(
+                                _mm256_extracti128_si256(v, 1)));
+    }
+
+    return i;
+}
+
+TARGET("avx2")
+static size_t
+narrow_avx2(void *dst, const uint16_t *src, size_t len)
+{
+    uint8_t *d = dst;
+    __m256i a, b, m;
+    size_t i;
+
+    m = _mm256_set1_epi16((short)0xFF80);
+    for (i = 0; i + 32 <= len; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(src + i));
+        b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), m))
+            break;
+        /* The packing is within 128-bit lanes; put them in order. */
+        _mm256_storeu_si256((__m256i *)(d + i),
+                            _mm256_permute4x64_epi64(
+                                _mm256_packus_epi16(a, b), 0xD8));
+    }
+
+    return i;
+}
+
+#endif /* XTF8_X86 */
+
+
+#ifdef XTF8_NEON
+
+static size_t
+ascii_neon(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    uint8x16_t v0, v1, v2, v3;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        v0 = vld1q_u8(s + i);
+        v1 = vld1q_u8(s + i + 16);
+        v2 = vld1q_u8(s + i + 32);
+        v3 = vld1q_u8(s + i + 48);
+        v0 = vorrq_u8(vorrq_u8(v0, v1), vorrq_u8(v2, v3));
+        if (vmaxvq_u8(v0) >= 0x80)
+            break;
+    }
+    for (; i + 16 <= len; i += 16) {
+        v0 = vld1q_u8(s + i);
+        if (vmaxvq_u8(v0) >= 0x80)
+            break;
+    }
+
+    return i;
+}
+
+static inline uint8x16_t
+json_mask_neon(uint8x16_t v)
+{
+    uint8x16_t m;
+
+    m = vcltq_u8(v, vdupq_n_u8(0x20));
+    m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+    m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+    return m;
+}
+
+static size_t
+json_neon(const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        if (vmaxvq_u8(json_mask_neon(vld1q_u8(s + i))) != 0)
+            break;
+    }
+
+    return i;
+}
+
+static size_t
+binary_neon(void *dst, const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    uint8x16_t v, m;
+    uint8x16x3_t t;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = vld1q_u8(s + i);
+        m = vandq_u8(vcgeq_u8(v, vdupq_n_u8(0x80)),
+                     vcleq_u8(v, vdupq_n_u8(0xC1)));
+        m = vorrq_u8(m, vcgeq_u8(v, vdupq_n_u8(0xF5)));
+        if (vminvq_u8(m) != 0xFF)
+            break;
+
+        /* U+EF80..U+EFFF: <EE, BE | bit6, 80 | bits0-5> */
+        t.val[0] = vdupq_n_u8(0xEE);
+        t.val[1] = vaddq_u8(vandq_u8(vshrq_n_u8(v, 6), vdupq_n_u8(1)),
+                            vdupq_n_u8(0xBE));
+        t.val[2] = vorrq_u8(vandq_u8(v, vdupq_n_u8(0x3F)),
+                            vdupq_n_u8(0x80));
+        vst3q_u8(d + i * 3, t);
+    }
+
+    return i;
+}
+
+/*
+ * See utf8_avx2().
+ */
+static size_t
+utf8_neon(const void *src, size_t len, size_t *npua)
+{
+    const uint8_t *s = src;
+    uint8x16_t t1, t2, t3, lim, v, prev, inc, p1, p2, p3, e, m;
+    size_t i, good, count, count_good;
+
+    t1 = vld1q_u8(utf8_lookup[0]);
+    t2 = vld1q_u8(utf8_lookup[1]);
+    t3 = vld1q_u8(utf8_lookup[2]);
+    lim = vld1q_u8(utf8_incomplete + 16);
+
+    prev = inc = vdupq_n_u8(0);
+    good = count = count_good = 0;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = vld1q_u8(s + i);
+
+        if (vmaxvq_u8(v) < 0x80) {
+            /* ASCII block; only valid if the previous one completed. */
+            if (vmaxvq_u8(inc) != 0)
+                break;
+            prev = v;
+            good = i + 16;
+            continue;
+        }
+
+        /* Previous 1..3 bytes of every byte */
+        p1 = vextq_u8(prev, v, 15);
+        p2 = vextq_u8(prev, v, 14);
+        p3 = vextq_u8(prev, v, 13);
+
+        e = vandq_u8(vqtbl1q_u8(t1, vshrq_n_u8(p1, 4)),
+                     vqtbl1q_u8(t2, vandq_u8(p1, vdupq_n_u8(0x0F))));
+        e = vandq_u8(e, vqtbl1q_u8(t3, vshrq_n_u8(v, 4)));
+
+        /* 3rd and 4th bytes must be continuations (TWO_CONTS) exactly. */
+        m = vorrq_u8(vqsubq_u8(p2, vdupq_n_u8(0xE0 - 0x80)),
+                     vqsubq_u8(p3, vdupq_n_u8(0xF0 - 0x80)));
+        e = veorq_u8(e, vandq_u8(m, vdupq_n_u8(0x80)));
+        if (vmaxvq_u8(e) != 0)
+            break;
+
+        m = vandq_u8(vceqq_u8(p1, vdupq_n_u8(0xEE)),
+                     vceqq_u8(vorrq_u8(v, vdupq_n_u8(1)),
+                              vdupq_n_u8(0xBF)));
+        count += vaddvq_u8(vshrq_n_u8(m, 7));
+
+        inc = vqsubq_u8(v, lim);
+        prev = v;
+        if (vmaxvq_u8(inc) == 0) {
+            good = i + 16;
+            count_good = count;
+        }
+    }
+
+    *npua += count_good;
+    return good;
+}
+
+static size_t
+widen_neon(uint16_t *dst, const void *src, size_t len)
+{
+    const uint8_t *s = src;
+    uint8x16_t v;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = vld1q_u8(s + i);
+        if (vmaxvq_u8(v) >= 0x80)
+            break;
+        vst1q_u16(dst + i, vmovl_u8(vget_low_u8(v)));
+        vst1q_u16(dst + i + 8, vmovl_high_u8(v));
+    }
+
+    return i;
+}
+
+static size_t
+narrow_neon(void *dst, const uint16_t *src, size_t len)
+{
+    uint8_t *d = dst;
+    uint16x8_t a, b;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        a = vld1q_u16(src + i);
+        b = vld1q_u16(src + i + 8);
+        if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80)
+            break;
+        vst1q_u8(d + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+    }
+
+    return i;
+}
+
+#endif /* XTF8_NEON */
+
+
+/*
+ * Kernels in the order of preference.
+ */
+static const struct xtf8_simd kernels[] = {
+#ifdef XTF8_X86
+    { "avx512bw", ascii_avx512, json_avx512, binary_ssse3, utf8_avx2,
+      widen_avx2, narrow_avx2 },
+    { "avx2", ascii_avx2, json_avx2, binary_ssse3, utf8_avx2,
+      widen_avx2, narrow_avx2 },
+    { "ssse3", ascii_sse2, json_sse2, binary_ssse3, utf8_ssse3,
+      widen_sse2, narrow_sse2 },
+    { "sse2", ascii_sse2, json_sse2, binary_scalar, utf8_scalar,
+      widen_sse2, narrow_sse2 },
+#endif
+#ifdef XTF8_NEON
+    { "neon", ascii_neon, json_neon, binary_neon, utf8_neon,
+      widen_neon, narrow_neon },
+#endif
+    { "scalar", ascii_scalar, json_scalar, binary_scalar, utf8_scalar,
+      widen_scalar, narrow_scalar },
+};
+
+static bool
+is_supported(const struct xtf8_simd *k)
+{
+#if defined(XTF8_X86)
+    __builtin_cpu_init();
+    if (strcmp(k->name, "avx512bw") == 0)
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+    if (strcmp(k->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(k->name, "ssse3") == 0)
+        return __builtin_cpu_supports("ssse3");
+    if (strcmp(k->name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#elif defined(XTF8_NEON) && defined(__linux__)
+    if (strcmp(k->name, "neon") == 0)
+        return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#endif
+    (void)k;
+    return true;
+}
+
+
+static size_t
+resolve_ascii(const void *src, size_t len)
+{
+    xtf8_simd_init();
+    return xtf8_simd_get()->ascii(src, len);
+}
+
+static size_t
+resolve_json(const void *src, size_t len)
+{
+    xtf8_simd_init();
+    return xtf8_simd_get()->json(src, len);
+}
+
+static size_t
+resolve_binary(void *dst, const void *src, size_t len)
+{
+    xtf8_simd_init();
+    return xtf8_simd_get()->binary(dst, src, len);
+}
+
+static size_t
+resolve_utf8(const void *src, size_t len, size_t *npua)
+{
+    xtf8_simd_init();
+    return xtf8_simd_get()->utf8(src, len, npua);
+}
+
+static size_t
+resolve_widen(uint16_t *dst, const void *src, size_t len)
+{
+    xtf8_simd_init();
+    return xtf8_simd_get()->widen(dst, src, len);
+}
+
+static size_t
+resolve_narrow(void *dst, const uint16_t *src, size_t len)
+{
+    xtf8_simd_init();
+    return xtf8_simd_get()->narrow(dst, src, len);
+}
+
+static const struct xtf8_simd unresolved = {
+    NULL, resolve_ascii, resolve_json, resolve_binary, resolve_utf8,
+    resolve_widen, resolve_narrow,
+};
+
+const struct xtf8_simd *xtf8_simd = &unresolved;
+
+
+/*
+ * Select the best kernel supported by the running CPU.  The selection
+ * can be restricted by setting the environment variable XTF8_KERNEL to
+ * a kernel name (e.g., "scalar"), which is ignored if not supported.
+ *
+ * This is called when the library is loaded, and also on first use in
+ * case the constructor did not run (e.g., static linking).  Running it
+ * concurrently is harmless because every call picks the same kernel,
+ * and the pointer is published atomically.
+ */
+__attribute__((constructor))
+void
+xtf8_simd_init(void)
+{
+    const struct xtf8_simd *k, *best;
+    const char *want;
+    size_t i;
+
+    want = getenv("XTF8_KERNEL");
+    best = NULL;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        k = &kernels[i];
+        if (!is_supported(k))
+            continue;
+        if (best == NULL)
+            best = k;
+        if (want != NULL && strcmp(want, k->name) == 0) {
+            best = k;
+            break;
+        }
+    }
+
+    __atomic_store_n(&xtf8_simd, best, __ATOMIC_RELEASE);
+}
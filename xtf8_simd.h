@@ -0,0 +1,111 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022-2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Vectorized kernels used by the codec (internal header).
+ */
+
+#ifndef XTF8_SIMD_H_
+#define XTF8_SIMD_H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint16_t */
+
+
+struct xtf8_simd {
+    const char *name; /* NULL if not yet resolved */
+
+    /*
+     * Return the length of the leading part of $src (of length $len)
+     * that consists of only ASCII characters.
+     *
+     * The kernels work on whole blocks, so the returned length may be
+     * less than the actual ASCII prefix; the caller is expected to check
+     * the remaining bytes in the scalar way.
+     */
+    size_t (*ascii)(const void *src, size_t len);
+
+    /*
+     * Similar to ascii(), but return the length of the leading part
+     * that contains no bytes needing JSON escaping, i.e., control
+     * characters, quotation mark (") and reverse solidus.
+     */
+    size_t (*json)(const void *src, size_t len);
+
+    /*
+     * Encode the leading run of bytes in $src (of length $len) that can't
+     * begin a UTF-8 sequence (i.e., 0x80..0xC1 and 0xF5..0xFF) to their
+     * 3-byte PUA sequences (EE BE xx / EE BF xx) in $dst, which must have
+     * room for ($len * 3) bytes; and return the number of bytes encoded.
+     *
+     * Same as ascii(), only whole blocks are processed.
+     */
+    size_t (*binary)(void *dst, const void *src, size_t len);
+
+    /*
+     * Return the length of the leading part of $src (of length $len)
+     * that is valid UTF-8 and ends at a character boundary, and add the
+     * number of PUA sequences (EE BE xx / EE BF xx) in it to $npua.
+     *
+     * Same as ascii(), only whole blocks are processed.
+     */
+    size_t (*utf8)(const void *src, size_t len, size_t *npua);
+
+    /*
+     * Widen the leading ASCII characters of $src (of length $len) to
+     * UTF-16 code units in $dst, which must have room for $len units;
+     * and return the number of characters widened.
+     *
+     * Same as ascii(), only whole blocks are processed.
+     */
+    size_t (*widen)(uint16_t *dst, const void *src, size_t len);
+
+    /*
+     * The reverse of widen(): narrow the leading UTF-16 code units of
+     * $src (of $len units) that are ASCII characters to bytes in $dst;
+     * and return the number of units narrowed.
+     */
+    size_t (*narrow)(void *dst, const uint16_t *src, size_t len);
+};
+
+/*
+ * Kernels selected for the running CPU.  They're internal to the
+ * library, so not exported; and the pointer may be set by any thread on
+ * first use, so it's accessed atomically.  Use xtf8_simd_get().
+ */
+extern const struct xtf8_simd *xtf8_simd
+    __attribute__((visibility("hidden")));
+
+__attribute__((visibility("hidden")))
+void xtf8_simd_init(void);
+
+static inline const struct xtf8_simd *
+xtf8_simd_get(void)
+{
+    return __atomic_load_n(&xtf8_simd, __ATOMIC_ACQUIRE);
+}
+
+
+#endif